@@ -10,106 +10,252 @@
 OSDefineMetaClassAndStructors(SerialMouseResources, IOService)
 OSDefineMetaClassAndStructors(SerialMouse, IOHIPointing)
 
+bool SerialMouse::init(OSDictionary *dictionary) {
+  if (!super::init(dictionary)) {
+    return false;
+  }
+
+  _coreAdapter.owner = this;
+  _core.attach(&_coreAdapter, &_coreAdapter);
+  return true;
+}
+
 IOService *SerialMouse::probe(IOService *provider, SInt32 *score) {
   DBGLOG("SerialMouse: probe()\n");
   if (!super::probe(provider, score)) {
     return nullptr;
   }
 
+  //
+  // Only cheap checks are done here, the mouse ID is checked asynchronously once started.
+  //
+  if (OSDynamicCast(IOSerialStreamSync, provider) == nullptr) {
+    SYSLOG("SerialMouse: Provider is not a serial stream\n");
+    return nullptr;
+  }
+  return this;
+}
+
+bool SerialMouse::start(IOService *provider) {
+  DBGLOG("SerialMouse: Starting\n");
+
   IOReturn status;
-  bool probed = false;
+  bool started = false;
   IOSerialStreamSync *serialStream = OSDynamicCast(IOSerialStreamSync, provider);
-  UInt32 origDataRate = 0, origDataSize = 0, origStopBits = 0, origFlowControl = 0;
-  
+
   if (serialStream == nullptr) {
     SYSLOG("SerialMouse: Provider is not a serial stream\n");
-    return nullptr;
+    return false;
   }
 
   //
-  // Acquire serial port.
+  // Select the configured protocol, otherwise it is detected from the mouse ID.
   //
-  if (acquirePort(serialStream) != kIOReturnSuccess) {
-    return nullptr;
+  OSString *protocol = OSDynamicCast(OSString, getProperty(kSerialMouseProtocolKey));
+  if (protocol != nullptr && protocol->isEqualTo(kSerialMouseProtocolNameMouseSystems)) {
+    _core.setProtocol(kSerialMouseProtocolMouseSystems);
+  } else {
+    _core.setProtocol(kSerialMouseProtocolMicrosoft);
+  }
+
+  OSNumber *idTimeout = OSDynamicCast(OSNumber, getProperty(kSerialMouseIdTimeoutKey));
+  if (idTimeout != nullptr && idTimeout->unsigned32BitValue() != 0) {
+    _idTimeoutMs = idTimeout->unsigned32BitValue();
+  }
+
+  OSNumber *coalesceThreshold = OSDynamicCast(OSNumber, getProperty(kSerialMouseCoalesceThresholdKey));
+  if (coalesceThreshold != nullptr) {
+    _core.setCoalesceThreshold(coalesceThreshold->unsigned32BitValue());
+  }
+
+  OSNumber *reportRate = OSDynamicCast(OSNumber, getProperty(kSerialMouseReportRateKey));
+  if (reportRate != nullptr) {
+    _core.setReportRate(reportRate->unsigned32BitValue());
+  }
+
+  OSString *threadPolicy = OSDynamicCast(OSString, getProperty(kSerialMouseThreadPolicyKey));
+  if (threadPolicy != nullptr) {
+    if (threadPolicy->isEqualTo(kSerialMouseThreadPolicyNameDefault)) {
+      _threadPolicy = kSerialMouseThreadPolicyDefault;
+    } else if (threadPolicy->isEqualTo(kSerialMouseThreadPolicyNamePrecedence)) {
+      _threadPolicy = kSerialMouseThreadPolicyPrecedence;
+    }
+  }
+
+  OSBoolean *sharedReader = OSDynamicCast(OSBoolean, getProperty(kSerialMouseSharedReaderKey));
+  if (sharedReader != nullptr) {
+    _sharedReader = sharedReader->isTrue();
+  }
+
+  OSBoolean *trace = OSDynamicCast(OSBoolean, getProperty(kSerialMouseTraceKey));
+  if (trace != nullptr) {
+    _core.getTrace().setEnabled(trace->isTrue());
   }
 
   //
-  // Save original port settings, setup stream, and check mouse ID.
+  // Setup port and begin mouse detection.
   //
   do {
-    status = getPortSettings(&origDataRate, &origDataSize, &origStopBits, &origFlowControl);
-    if (status != kIOReturnSuccess) {
-      SYSLOG("SerialMouse: Failed to set serial port settings during probe()\n");
+    //
+    // Shared readers run on the least busy shared work loop.
+    //
+    if (_sharedReader) {
+      _scheduler = SerialMouseScheduler::acquireShared();
+      if (_scheduler != nullptr) {
+        _workLoop = _scheduler->selectWorkLoop();
+        if (_workLoop != nullptr) {
+          _workLoop->retain();
+        } else {
+          SYSLOG("SerialMouse: Shared reader is full, using a receive thread\n");
+          SerialMouseScheduler::releaseShared();
+          _scheduler = nullptr;
+        }
+      } else {
+        SYSLOG("SerialMouse: Shared reader is unavailable, using a receive thread\n");
+      }
+    }
+    if (_workLoop == nullptr) {
+      _workLoop = IOWorkLoop::workLoop();
+    }
+    if (_workLoop == nullptr) {
+      SYSLOG("SerialMouse: Failed to create work loop\n");
       break;
     }
 
-    status = setupPort();
+    _commandGate = IOCommandGate::commandGate(this);
+    if (_commandGate == nullptr) {
+      SYSLOG("SerialMouse: Failed to create command gate\n");
+      break;
+    }
+    status = _workLoop->addEventSource(_commandGate);
     if (status != kIOReturnSuccess) {
-      SYSLOG("SerialMouse: Failed to setup serial port during probe()\n");
+      SYSLOG("SerialMouse: Failed to add command gate with status 0x%X\n", status);
       break;
     }
 
-    status = checkMouseId();
+    _idTimer = IOTimerEventSource::timerEventSource(this,
+      OSMemberFunctionCast(IOTimerEventSource::Action, this, &SerialMouse::handleMouseIdTimeout));
+    if (_idTimer == nullptr) {
+      SYSLOG("SerialMouse: Failed to create mouse ID timer\n");
+      break;
+    }
+    status = _workLoop->addEventSource(_idTimer);
     if (status != kIOReturnSuccess) {
-      SYSLOG("SerialMouse: Device on serial port is not a serial mouse\n");
+      SYSLOG("SerialMouse: Failed to add mouse ID timer with status 0x%X\n", status);
       break;
     }
 
-    probed = true;
-  } while (false);
-
-  //
-  // Restore port settings and release serial port.
-  //
-  setPortSettings(origDataRate, origDataSize, origStopBits, origFlowControl);
-  releasePort();
-  return probed ? this : nullptr;
-}
-
-bool SerialMouse::start(IOService *provider) {
-  DBGLOG("SerialMouse: Starting\n");
+    _extensionTimer = IOTimerEventSource::timerEventSource(this,
+      OSMemberFunctionCast(IOTimerEventSource::Action, this, &SerialMouse::handleExtensionTimeout));
+    if (_extensionTimer == nullptr) {
+      SYSLOG("SerialMouse: Failed to create extension byte timer\n");
+      break;
+    }
+    status = _workLoop->addEventSource(_extensionTimer);
+    if (status != kIOReturnSuccess) {
+      SYSLOG("SerialMouse: Failed to add extension byte timer with status 0x%X\n", status);
+      break;
+    }
 
-  IOReturn status;
-  bool started = false;
-  IOSerialStreamSync *serialStream = OSDynamicCast(IOSerialStreamSync, provider);
+    _pollThreadLock = IOLockAlloc();
+    if (_pollThreadLock == nullptr) {
+      SYSLOG("SerialMouse: Failed to allocate receive thread lock\n");
+      break;
+    }
 
-  if (serialStream == nullptr) {
-    SYSLOG("SerialMouse: Provider is not a serial stream\n");
-    return false;
-  }
+    _captureLock = IOLockAlloc();
+    if (_captureLock == nullptr) {
+      SYSLOG("SerialMouse: Failed to allocate capture lock\n");
+      break;
+    }
 
-  if (!super::start(provider)) {
-    return false;
-  }
+    _negotiateCall = thread_call_allocate(&SerialMouse::negotiateDataRate, this);
+    if (_negotiateCall == nullptr) {
+      SYSLOG("SerialMouse: Failed to allocate data rate negotiation call\n");
+      break;
+    }
 
-  //
-  // Setup port and start polling.
-  //
-  do {
     status = acquirePort(serialStream);
     if (status != kIOReturnSuccess) {
       SYSLOG("SerialMouse: Failed to acquire serial port\n");
       break;
     }
 
-    status = setupPort();
+    //
+    // Save original port settings so they can be restored if no mouse is present.
+    //
+    status = getPortSettings(&_origDataRate, &_origDataSize, &_origStopBits, &_origFlowControl);
+    if (status != kIOReturnSuccess) {
+      SYSLOG("SerialMouse: Failed to get serial port settings\n");
+      break;
+    }
+    _origSettingsSaved = true;
+
+    status = _core.setupPort();
     if (status != kIOReturnSuccess) {
-      SYSLOG("SerialMouse: Failed to setup serial port during probe()\n");
+      SYSLOG("SerialMouse: Failed to setup serial port\n");
       break;
     }
 
+    //
+    // Mouse Systems mice do not send an ID and can only be selected through the personality.
+    // Otherwise toggle DTR now and collect the ID as it arrives, without blocking matching of other ports.
+    //
+    if (_core.getProtocol() == kSerialMouseProtocolMouseSystems) {
+      status = startMouse();
+      if (status != kIOReturnSuccess) {
+        break;
+      }
+    } else {
+      _identifying = true;
+      clock_get_uptime(&_idStartTime);
+      status = _core.beginMouseId();
+      if (status != kIOReturnSuccess) {
+        SYSLOG("SerialMouse: Failed to reset mouse with status 0x%X\n", status);
+        break;
+      }
+      _idTimer->setTimeoutMS(_idTimeoutMs);
+    }
+
+    //
+    // Fall back to a receive thread if the shared work loop has no room for another port.
+    //
+    if (_scheduler != nullptr) {
+      status = _scheduler->addPort(this, _workLoop);
+      if (status == kIOReturnSuccess) {
+        //
+        // Lane work loops are shared by many ports, so a policy sized to one mouse is not applied to them.
+        //
+        if (_threadPolicy != kSerialMouseThreadPolicyDefault) {
+          SYSLOG("SerialMouse: ReaderThreadPolicy does not apply to the shared reader\n");
+        }
+        started = true;
+        break;
+      }
+      SYSLOG("SerialMouse: Shared reader could not add the port, using a receive thread\n");
+      _scheduler->releaseWorkLoop(_workLoop);
+      SerialMouseScheduler::releaseShared();
+      _scheduler = nullptr;
+    }
+
+    _pollThreadRunning = true;
     status = kernel_thread_start(OSMemberFunctionCast(thread_continue_t, this, &SerialMouse::pollMouseThread),
                                  this, &_pollThread);
     if (status != kIOReturnSuccess) {
-      SYSLOG("SerialMouse: Polling thread could not be created\n");
+      SYSLOG("SerialMouse: Receive thread could not be created\n");
+      _pollThreadRunning = false;
       break;
     }
+    applyThreadPolicy();
 
     started = true;
-    SYSLOG("SerialMouse: Serial mouse started\n");
   } while (false);
 
+  //
+  // Leave the port as it was found for other clients.
+  //
   if (!started) {
+    restorePortSettings();
     stop(provider);
   }
   return started;
@@ -117,161 +263,772 @@ bool SerialMouse::start(IOService *provider) {
 
 void SerialMouse::stop(IOService *provider) {
   //
-  // Kill polling thread.
+  // Removing the sleep/wake notifier waits for a running handler, so none can reach the port once it is released.
+  //
+  if (_sleepWakeNotifier != nullptr) {
+    _sleepWakeNotifier->remove();
+    _sleepWakeNotifier = nullptr;
+  }
+
+  //
+  // Stop mouse ID and extension byte timers. Disabling them waits for a running timeout handler to complete,
+  // the receive thread is cancelled first so it stops draining data in the meantime.
+  //
+  _core.cancelReceive();
+  if (_idTimer != nullptr) {
+    _idTimer->cancelTimeout();
+    _idTimer->disable();
+  }
+  if (_extensionTimer != nullptr) {
+    _extensionTimer->cancelTimeout();
+    _extensionTimer->disable();
+  }
+  _identifying = false;
+
+  //
+  // Wait for a running negotiation, which uses the port and posts its result through the command gate.
+  // thread_call_cancel_wait() requires 10.8, so the call clears _negotiateRunning itself once it no longer
+  // touches the driver. One cancelled before it ran never clears it, nor resumes receiving by itself.
+  //
+  if (_negotiateCall != nullptr) {
+    IOLockLock(_pollThreadLock);
+    if (thread_call_cancel(_negotiateCall)) {
+      _negotiateRunning = false;
+    }
+    while (_negotiateRunning) {
+      IOLockSleep(_pollThreadLock, &_negotiateRunning, THREAD_UNINT);
+    }
+    IOLockUnlock(_pollThreadLock);
+
+    thread_call_free(_negotiateCall);
+    _negotiateCall = nullptr;
+  }
+  endNegotiation();
+
+  //
+  // The port can only be released once the receive thread or shared reader is no longer using it.
   //
+  if (_scheduler != nullptr) {
+    _scheduler->removePort(this, _workLoop);
+    _scheduler->releaseWorkLoop(_workLoop);
+    SerialMouseScheduler::releaseShared();
+    _scheduler = nullptr;
+  }
+  stopPollThread();
   releasePort();
-  thread_terminate(_pollThread);
-  thread_deallocate(_pollThread);
 
-  super::stop(provider);
+  if (_workLoop != nullptr) {
+    if (_idTimer != nullptr) {
+      _workLoop->removeEventSource(_idTimer);
+    }
+    if (_extensionTimer != nullptr) {
+      _workLoop->removeEventSource(_extensionTimer);
+    }
+    if (_commandGate != nullptr) {
+      _workLoop->removeEventSource(_commandGate);
+    }
+  }
+  OSSafeReleaseNULL(_idTimer);
+  OSSafeReleaseNULL(_extensionTimer);
+  OSSafeReleaseNULL(_commandGate);
+  OSSafeReleaseNULL(_workLoop);
+  if (_pollThreadLock != nullptr) {
+    IOLockFree(_pollThreadLock);
+    _pollThreadLock = nullptr;
+  }
+
+  _core.getCapture().detach();
+  if (_captureBuffer != nullptr) {
+    IOFree(_captureBuffer, MOUSE_CAPTURE_SIZE);
+    _captureBuffer = nullptr;
+  }
+  if (_captureLock != nullptr) {
+    IOLockFree(_captureLock);
+    _captureLock = nullptr;
+  }
+  OSSafeReleaseNULL(_traceArray);
+  OSSafeReleaseNULL(_captureData);
+
+  if (_hidStarted) {
+    _hidStarted = false;
+    super::stop(provider);
+  }
 }
 
-void SerialMouse::pollMouseThread(void) {
-  DBGLOG("SerialMouse: Polling thread\n");
-  
-  UInt8 packetByte;
-  UInt32 count = 0;
-  UInt32 packetSequence = 0;
-  
-  UInt8 packet[MOUSE_PACKET_LENGTH];
-  
-  while (true) {
+bool SerialMouse::serializeProperties(OSSerialize *serialize) const {
+  const SerialMouseStatistics &stats = _core.getStatistics();
+  const struct {
+    const char *key;
+    uint32_t   value;
+  } counters[] = {
+    { "BytesRead",             stats.bytesRead },
+    { "PacketsDecoded",        stats.packetsDecoded },
+    { "HeaderResyncs",         stats.headerResyncs },
+    { "DroppedPartialPackets", stats.droppedPartialPackets },
+    { "DequeueErrors",         stats.dequeueErrors },
+    { "EventsDispatched",      stats.eventsDispatched },
+    { "CoalescedPackets",      stats.coalescedPackets },
+    { "NullPacketsSuppressed", stats.nullPacketsSuppressed },
+    { "PacketRate",            stats.packetRate },
+    { "DispatchLatency",       stats.dispatchLatencyUs },
+    { "MaxDispatchLatency",    stats.maxDispatchLatencyUs }
+  };
+
+  //
+  // Statistics, histograms, the trace and a stopped capture are only returned with a copy of the properties
+  // when the registry is read, instead of being set on the entry. The counters are only written by the polling
+  // thread and are read without locking.
+  //
+  OSDictionary *properties = dictionaryWithProperties();
+  if (properties == nullptr) {
+    return super::serializeProperties(serialize);
+  }
+
+  OSDictionary *dictionary = OSDictionary::withCapacity(sizeof (counters) / sizeof (counters[0]));
+  if (dictionary != nullptr) {
+    for (size_t i = 0; i < sizeof (counters) / sizeof (counters[0]); i++) {
+      OSNumber *number = OSNumber::withNumber(counters[i].value, 32);
+      if (number != nullptr) {
+        dictionary->setObject(counters[i].key, number);
+        number->release();
+      }
+    }
+
+    properties->setObject(kSerialMouseStatisticsKey, dictionary);
+    dictionary->release();
+  }
+
+  addHistogram(properties, kSerialMouseLatencyHistogramKey, _core.getLatencyHistogram());
+  addHistogram(properties, kSerialMouseIntervalHistogramKey, _core.getIntervalHistogram());
+  addHistogram(properties, kSerialMouseWakeupHistogramKey, _core.getWakeupHistogram());
+
+  if (_captureLock != nullptr) {
+    IOLockLock(_captureLock);
+    updateTrace();
+    updateCapture();
+    if (_traceArray != nullptr) {
+      properties->setObject(kSerialMouseTraceDataKey, _traceArray);
+    }
+    if (_captureData != nullptr) {
+      properties->setObject(kSerialMouseCaptureDataKey, _captureData);
+    }
+    IOLockUnlock(_captureLock);
+  }
+
+  bool result = properties->serialize(serialize);
+  properties->release();
+  return result;
+}
+
+IOReturn SerialMouse::setProperties(OSObject *properties) {
+  OSDictionary *dictionary = OSDynamicCast(OSDictionary, properties);
+
+  //
+  // Report rate can be changed at runtime.
+  //
+  if (dictionary != nullptr) {
+    OSNumber *reportRate = OSDynamicCast(OSNumber, dictionary->getObject(kSerialMouseReportRateKey));
+    if (reportRate != nullptr) {
+      if (_commandGate != nullptr) {
+        _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SerialMouse::handleSetReportRate),
+                                reinterpret_cast<void *>(static_cast<uintptr_t>(reportRate->unsigned32BitValue())));
+      } else {
+        _core.setReportRate(reportRate->unsigned32BitValue());
+      }
+      setProperty(kSerialMouseReportRateKey, _core.getReportRate(), 32);
+    }
+
     //
-    // If serial stream is null, exit.
+    // Tracing can be switched on and off at any time.
     //
-    if (_serialStream == nullptr) {
-      break;
+    OSBoolean *trace = OSDynamicCast(OSBoolean, dictionary->getObject(kSerialMouseTraceKey));
+    if (trace != nullptr) {
+      _core.getTrace().setEnabled(trace->isTrue());
+      setProperty(kSerialMouseTraceKey, trace);
     }
-    
+
     //
-    // Read next byte. If the sync is off, need to get in sync first.
+    // Histograms are cleared on request, for example before a measurement run.
     //
-    if (_serialStream->dequeueData(&packetByte, 1, &count, 1) == kIOReturnSuccess) {
-      DBGLOG("SerialMouse::pollMouseThread(): got packet byte %X seq %u\n", packetByte, packetSequence);
-      
-      //
-      // If we are expecting the first byte of the packet but did not receive it, discard byte.
-      //
-      if (packetByte & MOUSE_PACKET_HEADER_BIT) {
-        packetSequence = 0;
-      }
-      
-      packet[packetSequence] = packetByte;
-      packetSequence++;
-      
-      if (packetSequence >= MOUSE_PACKET_LENGTH) {
-        packetSequence = 0;
-        
-        // Get current time.
-        uint64_t now_abs;
-        clock_get_uptime(&now_abs);
-        uint64_t now_ns;
-        absolutetime_to_nanoseconds(now_abs, &now_ns);
+    OSBoolean *resetHistograms = OSDynamicCast(OSBoolean, dictionary->getObject(kSerialMouseResetHistogramsKey));
+    if (resetHistograms != nullptr && resetHistograms->isTrue() && _commandGate != nullptr) {
+      _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SerialMouse::handleResetHistograms));
+    }
 
-        //
-        // Dispatch pointer movement event.
-        //
-        dispatchRelativePointerEvent(MOUSE_PACKET_POSX(packet), MOUSE_PACKET_POSY(packet),
-                                     MOUSE_PACKET_BUTTONS(packet), *(AbsoluteTime*)&now_ns);
+    //
+    // Raw capture is started and stopped at runtime.
+    //
+    OSBoolean *capture = OSDynamicCast(OSBoolean, dictionary->getObject(kSerialMouseCaptureKey));
+    if (capture != nullptr && _commandGate != nullptr) {
+      _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &SerialMouse::handleSetCapture),
+                              reinterpret_cast<void *>(static_cast<uintptr_t>(capture->isTrue())));
+    }
+  }
+  return super::setProperties(properties);
+}
+
+void SerialMouse::addHistogram(OSDictionary *properties, const char *key, const SerialMouseHistogram &histogram) {
+  OSArray *array = OSArray::withCapacity(MOUSE_HISTOGRAM_BUCKETS);
+  if (array == nullptr) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < MOUSE_HISTOGRAM_BUCKETS; i++) {
+    OSNumber *number = OSNumber::withNumber(histogram.buckets[i], 32);
+    if (number != nullptr) {
+      array->setObject(number);
+      number->release();
+    }
+  }
+
+  properties->setObject(key, array);
+  array->release();
+}
+
+IOReturn SerialMouse::handleResetHistograms() {
+  _core.resetHistograms();
+  return kIOReturnSuccess;
+}
+
+void SerialMouse::updateTrace() const {
+  SerialMouseTraceRecord *records;
+  uint32_t count;
+  uint32_t head;
+  char     line[96];
+
+  //
+  // Format the trace when the registry is read, keeping formatting out of the receive path.
+  // Records are only added while tracing is enabled, so an unchanged head means the last copy is current.
+  //
+  head = _core.getTrace().getHead();
+  if (head == _traceHead) {
+    return;
+  }
+
+  records = static_cast<SerialMouseTraceRecord *>(IOMalloc(sizeof (*records) * MOUSE_TRACE_COUNT));
+  if (records == nullptr) {
+    return;
+  }
+
+  count = _core.getTrace().copyOut(records, MOUSE_TRACE_COUNT);
+  OSArray *array = (count > 0) ? OSArray::withCapacity(count) : nullptr;
+  if (array != nullptr) {
+    for (uint32_t i = 0; i < count; i++) {
+      SerialMouseTrace::format(records[i], line, sizeof (line));
+      OSString *string = OSString::withCString(line);
+      if (string != nullptr) {
+        array->setObject(string);
+        string->release();
       }
     }
+
+    OSSafeReleaseNULL(_traceArray);
+    _traceArray = array;
+    _traceHead  = head;
   }
+  IOFree(records, sizeof (*records) * MOUSE_TRACE_COUNT);
 }
 
-IOReturn SerialMouse::acquirePort(IOSerialStreamSync *serialStream) {
-  DBGLOG("SerialMouse: Acquiring serial port\n");
+void SerialMouse::updateCapture() const {
+  const SerialMouseCapture &capture = _core.getCapture();
 
-  IOReturn status = serialStream->acquirePort(false);
-  if (status != kIOReturnSuccess) {
-    SYSLOG("SerialMouse: Failed to acquire serial port with status 0x%X\n", status);
-    return status;
+  //
+  // Captures are not returned while recording as the buffer is changing. A stopped capture is copied once,
+  // starting or stopping another one discards the copy.
+  //
+  if (_captureData != nullptr || capture.isActive() || capture.getLength() == 0) {
+    return;
   }
 
-  _serialStream = serialStream;
-  _serialStream->retain();
-  return status;
+  size_t   captureSize   = MOUSE_CAPTURE_HEADER_SIZE + capture.getLength();
+  uint8_t *captureBuffer = static_cast<uint8_t *>(IOMalloc(captureSize));
+  if (captureBuffer != nullptr) {
+    captureSize  = capture.copyOut(captureBuffer, captureSize, _core.getProtocol(), _core.getDataRate());
+    _captureData = OSData::withBytes(captureBuffer, static_cast<unsigned int>(captureSize));
+    IOFree(captureBuffer, MOUSE_CAPTURE_HEADER_SIZE + capture.getLength());
+  }
 }
 
-void SerialMouse::releasePort() {
-  DBGLOG("SerialMouse: Releasing serial port\n");
+IOReturn SerialMouse::handleSetCapture(void *enable) {
+  SerialMouseCapture &capture = _core.getCapture();
+  IOReturn status = kIOReturnSuccess;
 
   //
-  // Deactivate and release port.
+  // Starting a capture discards the previous one. The buffer is only allocated once a capture is requested.
   //
-  if (_serialStream != nullptr) {
-    if (_serialStream->executeEvent(PD_E_ACTIVE, false) == kIOReturnSuccess) {
-      _serialStream->releasePort();
+  IOLockLock(_captureLock);
+  OSSafeReleaseNULL(_captureData);
+  if (enable != nullptr) {
+    if (_captureBuffer == nullptr) {
+      _captureBuffer = static_cast<uint8_t *>(IOMalloc(MOUSE_CAPTURE_SIZE));
+    }
+
+    if (_captureBuffer != nullptr) {
+      capture.attach(_captureBuffer, MOUSE_CAPTURE_SIZE);
+      capture.setActive(true);
+      DBGLOG("SerialMouse: Capture started\n");
+    } else {
+      SYSLOG("SerialMouse: Failed to allocate capture buffer\n");
+      status = kIOReturnNoMemory;
     }
+  } else {
+    capture.setActive(false);
+    DBGLOG("SerialMouse: Capture stopped with %u bytes\n", capture.getLength());
   }
-  OSSafeReleaseNULL(_serialStream);
+  IOLockUnlock(_captureLock);
+  return status;
 }
 
-IOReturn SerialMouse::setupPort() {
-  DBGLOG("SerialMouse: Setting up port\n");
-  IOReturn status;
+IOReturn SerialMouse::handleSetReportRate(void *reportRate) {
+  _core.setReportRate(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(reportRate)));
 
   //
-  // Set up and activate port.
+  // A mouse that is still being identified gets the new rate once negotiation completes.
   //
-  status = setPortSettings(MOUSE_DATA_RATE, MOUSE_DATA_SIZE, MOUSE_STOP_BITS, MOUSE_FLOW_CONTROL);
-  if (status != kIOReturnSuccess) {
-    return status;
+  if (!_hidStarted || _identifying || _serialStream == nullptr || _core.isReceiveCancelled()) {
+    return kIOReturnSuccess;
   }
-  return _serialStream->executeEvent(PD_E_ACTIVE, true);
+  return _core.applyReportRate();
 }
 
-IOReturn SerialMouse::flushPort() {
-  DBGLOG("SerialMouse: Flushing port\n");
-  return _serialStream->executeEvent(PD_E_RXQ_FLUSH, 0);
+IOReturn SerialMouse::handleSleepWake(void *target, void *refCon, UInt32 messageType, IOService *provider,
+                                      void *messageArgument, vm_size_t argSize) {
+  SerialMouse *serialMouse = static_cast<SerialMouse *>(target);
+
+  if (messageType == kIOMessageSystemHasPoweredOn && serialMouse->_commandGate != nullptr) {
+    serialMouse->_commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, serialMouse, &SerialMouse::handleWake));
+  }
+  return kIOReturnSuccess;
 }
 
-IOReturn SerialMouse::checkMouseId() {
-  DBGLOG("SerialMouse: Checking mouse ID\n");
+IOReturn SerialMouse::handleWake() {
   IOReturn status;
-  UInt8 mouseId = 0;
-  UInt32 count = 0;
+
+  if (!_hidStarted || _negotiating || _serialStream == nullptr || _core.isReceiveCancelled()) {
+    return kIOReturnNotReady;
+  }
+  DBGLOG("SerialMouse: Restoring mouse after wake\n");
 
   //
-  // Flush receive buffer.
+  // Return the port to the ID settings, the mouse is back at 1200 baud if it lost power.
+  // Mouse Systems mice do not send an ID and need nothing else.
   //
-  status = flushPort();
+  status = _core.setupPort();
   if (status != kIOReturnSuccess) {
+    SYSLOG("SerialMouse: Failed to setup serial port after wake with status 0x%X\n", status);
     return status;
   }
+  if (_core.getProtocol() == kSerialMouseProtocolMouseSystems) {
+    return kIOReturnSuccess;
+  }
 
   //
-  // Toggle DTR bit.
+  // Reset and identify the mouse again. Completion negotiates the data rate and sends the report rate as on start.
   //
-  status = _serialStream->executeEvent(PD_E_FLOW_CONTROL, MOUSE_FLOW_CONTROL);
+  _wakeProtocol = _core.getProtocol();
+  _identifying  = true;
+  clock_get_uptime(&_idStartTime);
+  status = _core.beginMouseId();
   if (status != kIOReturnSuccess) {
+    SYSLOG("SerialMouse: Failed to reset mouse after wake with status 0x%X\n", status);
+    completeMouseId(status);
     return status;
   }
-  status = _serialStream->executeEvent(PD_E_FLOW_CONTROL, MOUSE_FLOW_CONTROL & ~PD_RS232_S_DTR);
-  if (status != kIOReturnSuccess) {
-    return status;
+  _idTimer->cancelTimeout();
+  _idTimer->setTimeoutMS(_idTimeoutMs);
+  return kIOReturnSuccess;
+}
+
+void SerialMouse::handleMouseIdData() {
+  _core.processRingBuffer();
+  if (!_identifying) {
+    return;
   }
-  status = _serialStream->executeEvent(PD_E_FLOW_CONTROL, MOUSE_FLOW_CONTROL);
+
+  switch (_core.getMouseIdState()) {
+    //
+    // ID byte received, record the response time and give the extension byte a short time to arrive.
+    //
+    case kSerialMouseIdExtensionPending: {
+      uint64_t now;
+      uint64_t elapsedNs;
+      clock_get_uptime(&now);
+      absolutetime_to_nanoseconds(now - _idStartTime, &elapsedNs);
+      setProperty(kSerialMouseIdResponseTimeKey, elapsedNs / kMillisecondScale, 32);
+      DBGLOG("SerialMouse: Mouse ID received after %llu ms\n", elapsedNs / kMillisecondScale);
+
+      _idTimer->cancelTimeout();
+      _idTimer->setTimeoutMS(MOUSE_ID_EXT_DELAY_MS);
+      break;
+    }
+
+    //
+    // Logitech mice negotiate a higher data rate first, the ID completes once that is done.
+    //
+    case kSerialMouseIdComplete:
+      if (_core.getProtocol() == kSerialMouseProtocolLogitech) {
+        _idTimer->cancelTimeout();
+        IOLockLock(_pollThreadLock);
+        _negotiating      = true;
+        _negotiateRunning = true;
+        IOLockUnlock(_pollThreadLock);
+        thread_call_enter(_negotiateCall);
+        break;
+      }
+      completeMouseId(kIOReturnSuccess);
+      break;
+
+    case kSerialMouseIdFailed:
+      completeMouseId(kIOReturnNoDevice);
+      break;
+
+    default:
+      break;
+  }
+}
+
+void SerialMouse::negotiateDataRate(thread_call_param_t param0, thread_call_param_t param1) {
+  SerialMouse *serialMouse = static_cast<SerialMouse *>(param0);
+
+  if (!serialMouse->_core.isReceiveCancelled() && serialMouse->_core.negotiateDataRate() != kIOReturnSuccess) {
+    SYSLOG("SerialMouse: Failed to negotiate data rate, using %u baud\n", serialMouse->_core.getDataRate());
+  }
+  serialMouse->_commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, serialMouse,
+                                                            &SerialMouse::handleNegotiateComplete));
+
+  //
+  // Let stop() free the call and release the port.
+  //
+  IOLockLock(serialMouse->_pollThreadLock);
+  serialMouse->_negotiateRunning = false;
+  IOLockWakeup(serialMouse->_pollThreadLock, &serialMouse->_negotiateRunning, false);
+  IOLockUnlock(serialMouse->_pollThreadLock);
+}
+
+IOReturn SerialMouse::handleNegotiateComplete() {
+  endNegotiation();
+  updateThreadPolicy();
+  if (!_identifying || _core.isReceiveCancelled()) {
+    return kIOReturnAborted;
+  }
+
+  completeMouseId(kIOReturnSuccess);
+  return kIOReturnSuccess;
+}
+
+void SerialMouse::endNegotiation() {
+  if (_pollThreadLock == nullptr) {
+    return;
+  }
+
+  //
+  // Resume receiving, including a receive thread waiting for the negotiation to end.
+  //
+  IOLockLock(_pollThreadLock);
+  _negotiating = false;
+  IOLockWakeup(_pollThreadLock, &_negotiating, false);
+  IOLockUnlock(_pollThreadLock);
+}
+
+void SerialMouse::handleMouseIdTimeout(IOTimerEventSource *sender) {
+  //
+  // With packet wakeups, as after wake, an ID shorter than a packet stays queued until it is drained here.
+  //
+  if (_identifying) {
+    _core.markWakeup();
+    drainReceiveQueue(0);
+  }
+  if (_identifying && !_negotiating) {
+    completeMouseId(_core.completeMouseId());
+  }
+}
+
+void SerialMouse::completeMouseId(IOReturn status) {
+  _identifying = false;
+  _idTimer->cancelTimeout();
+
+  //
+  // A mouse identified again after wake is already registered. If it did not answer, keep decoding
+  // with the protocol it had before sleep.
+  //
+  if (_hidStarted) {
+    if (status == kIOReturnSuccess) {
+      setProperty(kSerialMouseDataRateKey, _core.getDataRate(), 32);
+      setupReceiveQueue();
+      DBGLOG("SerialMouse: Serial mouse restored at %u baud\n", _core.getDataRate());
+    } else {
+      SYSLOG("SerialMouse: Serial mouse did not respond after wake\n");
+      _core.resumeProtocol(_wakeProtocol);
+    }
+    updateThreadPolicy();
+    return;
+  }
+
+  if (status == kIOReturnSuccess) {
+    status = startMouse();
+  } else {
+    SYSLOG("SerialMouse: Device on serial port is not a serial mouse\n");
+  }
+
+  //
+  // Restore port settings and give up the port if there is no mouse.
+  //
   if (status != kIOReturnSuccess) {
-    return status;
+    restorePortSettings();
+    terminate();
+  }
+}
+
+IOReturn SerialMouse::startMouse() {
+  //
+  // Register with the HID system.
+  //
+  if (!super::start(getProvider())) {
+    SYSLOG("SerialMouse: Failed to start pointing device\n");
+    return kIOReturnError;
+  }
+  _hidStarted = true;
+  setProperty(kSerialMouseDataRateKey, _core.getDataRate(), 32);
+  setupReceiveQueue();
+  applyThreadPolicy();
+
+  _sleepWakeNotifier = registerPrioritySleepWakeInterest(&SerialMouse::handleSleepWake, this);
+  if (_sleepWakeNotifier == nullptr) {
+    SYSLOG("SerialMouse: Failed to register for sleep/wake notifications\n");
+  }
+
+  SYSLOG("SerialMouse: Serial mouse started at %u baud\n", _core.getDataRate());
+  return kIOReturnSuccess;
+}
+
+void SerialMouse::setupReceiveQueue() {
+  UInt32 packetLength = _core.getPacketLength();
+
+  //
+  // Size the receive queue and watermarks from the packet length. The high water state is set once the
+  // queue holds more than the high watermark. Not all serial drivers support this, those keep per-byte wakeups.
+  //
+  _serialStream->executeEvent(PD_E_RXQ_SIZE, packetLength * MOUSE_RXQ_PACKET_COUNT);
+  bool packetWatermark = _serialStream->executeEvent(PD_E_RXQ_LOW_WATER, 0) == kIOReturnSuccess
+                      && _coreAdapter.setWakeupThreshold(packetLength) == kIOReturnSuccess;
+  _core.setPacketWakeup(packetWatermark);
+  DBGLOG("SerialMouse: Receive queue packet watermark %s\n", packetWatermark ? "enabled" : "unsupported");
+}
+
+void SerialMouse::applyThreadPolicy() {
+  kern_return_t result = KERN_SUCCESS;
+
+  if (_pollThread == nullptr) {
+    return;
+  }
+  _threadPolicyByteTimeNs   = _core.getByteTimeNs();
+  _threadPolicyPacketLength = _core.getPacketLength();
+
+  switch (_threadPolicy) {
+    //
+    // Run periodically at the packet rate, and handle each wakeup within a byte time so the next byte is not delayed.
+    // This is applied again once the data rate is known.
+    //
+    case kSerialMouseThreadPolicyTimeConstraint: {
+      uint64_t period;
+      uint64_t computation;
+      uint64_t constraint;
+      nanoseconds_to_absolutetime(_core.getPacketLength() * _core.getByteTimeNs(), &period);
+      nanoseconds_to_absolutetime(MOUSE_THREAD_COMPUTATION_US * 1000ULL, &computation);
+      nanoseconds_to_absolutetime(_core.getByteTimeNs(), &constraint);
+
+      thread_time_constraint_policy_data_t policy;
+      policy.period      = (uint32_t) period;
+      policy.computation = (uint32_t) computation;
+      policy.constraint  = (uint32_t) constraint;
+      policy.preemptible = true;
+      result = thread_policy_set(_pollThread, THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t) &policy,
+                                 THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+      break;
+    }
+
+    case kSerialMouseThreadPolicyPrecedence: {
+      thread_precedence_policy_data_t policy;
+      policy.importance = MOUSE_THREAD_IMPORTANCE;
+      result = thread_policy_set(_pollThread, THREAD_PRECEDENCE_POLICY, (thread_policy_t) &policy,
+                                 THREAD_PRECEDENCE_POLICY_COUNT);
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  if (result != KERN_SUCCESS) {
+    SYSLOG("SerialMouse: Failed to set receive thread policy with status 0x%X\n", result);
+  }
+}
+
+void SerialMouse::updateThreadPolicy() {
+  //
+  // Negotiation and identifying again after wake can change the data rate or protocol of a running mouse.
+  //
+  if (_core.getByteTimeNs() != _threadPolicyByteTimeNs || _core.getPacketLength() != _threadPolicyPacketLength) {
+    applyThreadPolicy();
+  }
+}
+
+void SerialMouse::stopPollThread() {
+  uint64_t startTime;
+  uint64_t endTime;
+  uint64_t deadline;
+  uint64_t elapsedNs;
+  AbsoluteTime deadlineTime;
+  bool exited;
+
+  if (_pollThread == nullptr) {
+    return;
+  }
+
+  //
+  // Request cancellation, which wakes the thread by deactivating the port and failing its pending watchState().
+  //
+  clock_get_uptime(&startTime);
+  _core.cancelReceive();
+
+  //
+  // Wait a bounded time for the thread to exit.
+  //
+  clock_interval_to_deadline(MOUSE_THREAD_EXIT_TIMEOUT_MS, kMillisecondScale, &deadline);
+  AbsoluteTime_to_scalar(&deadlineTime) = deadline;
+
+  IOLockLock(_pollThreadLock);
+  while (_pollThreadRunning) {
+    if (IOLockSleepDeadline(_pollThreadLock, &_pollThreadRunning, deadlineTime, THREAD_UNINT) == THREAD_TIMED_OUT) {
+      break;
+    }
+  }
+  exited = !_pollThreadRunning;
+  IOLockUnlock(_pollThreadLock);
+
+  //
+  // The serial driver did not wake the thread, terminate it as a last resort.
+  //
+  if (!exited) {
+    SYSLOG("SerialMouse: Receive thread did not exit within %u ms, terminating it\n", MOUSE_THREAD_EXIT_TIMEOUT_MS);
+    thread_terminate(_pollThread);
   }
+  thread_deallocate(_pollThread);
+  _pollThread = nullptr;
+
+  clock_get_uptime(&endTime);
+  absolutetime_to_nanoseconds(endTime - startTime, &elapsedNs);
+  DBGLOG("SerialMouse: Receive thread stopped in %llu us\n", elapsedNs / 1000);
+}
+
+void SerialMouse::pollMouseThread(void) {
+  DBGLOG("SerialMouse: Receive thread\n");
+
+  _core.runReceiveLoop(&_coreAdapter);
+
+  IOLockLock(_pollThreadLock);
+  _pollThreadRunning = false;
+  IOLockWakeup(_pollThreadLock, &_pollThreadRunning, false);
+  IOLockUnlock(_pollThreadLock);
+}
+
+IOReturn SerialMouse::handleReceiveData(void *wakeTimeNs, void *wakeBytes) {
+  IOReturn status;
+
+  _core.markWakeup(*static_cast<uint64_t *>(wakeTimeNs), static_cast<uint32_t>(reinterpret_cast<uintptr_t>(wakeBytes)));
+  status = drainReceiveQueue(0);
 
   //
-  // Read ID byte.
+  // With packet wakeups, a Logitech extension byte arriving after the packet would wait for the next packet.
+  // Collect it once it has had time to arrive instead.
   //
-  IOSleep(MOUSE_ID_DELAY_MS);
-  status = _serialStream->dequeueData(&mouseId, 1, &count, 0);
-  DBGLOG("SerialMouse::checkMouseId(): device returned ID byte 0x%X\n", mouseId);
+  if (status == kIOReturnSuccess && _core.getPacketWakeup() && _core.isExtensionPending()) {
+    _extensionTimer->setTimeoutUS((UInt32) (MOUSE_EXTENSION_WAIT_BYTES * _core.getByteTimeNs() / 1000));
+  }
+  return status;
+}
+
+void SerialMouse::handleExtensionTimeout(IOTimerEventSource *sender) {
+  _core.markWakeup();
+  if (drainReceiveQueue(0) == kIOReturnSuccess) {
+    _core.releasePartialPacket();
+  }
+}
+
+bool SerialMouse::serviceReceive(UInt32 maxReads) {
+  //
+  // Called on the shared work loop. Ports without queued data are skipped without a read.
+  //
+  if (_core.isReceiveCancelled() || _serialStream == nullptr || (_serialStream->getState() & PD_S_RXQ_EMPTY)) {
+    return false;
+  }
+  _core.markWakeup();
+  drainReceiveQueue(maxReads);
+  return true;
+}
+
+IOReturn SerialMouse::drainReceiveQueue(UInt32 maxReads) {
+  IOReturn status;
+  uint32_t count;
+  UInt32   reads = 0;
+
+  //
+  // Drain queued data without blocking, and dispatch all complete packets.
+  // A read limit of zero drains everything queued.
+  //
+  do {
+    if (_core.isReceiveCancelled()) {
+      return kIOReturnAborted;
+    }
+    if (_negotiating) {
+      return kIOReturnBusy;
+    }
+    if (maxReads != 0 && reads++ >= maxReads) {
+      status = kIOReturnSuccess;
+      break;
+    }
+
+    status = _core.receiveData(0, &count);
+    if (status != kIOReturnSuccess || count == 0) {
+      break;
+    }
+
+    if (_identifying) {
+      handleMouseIdData();
+    } else {
+      _core.processRingBuffer();
+    }
+  } while (true);
+
+  return status;
+}
+
+IOReturn SerialMouse::acquirePort(IOSerialStreamSync *serialStream) {
+  DBGLOG("SerialMouse: Acquiring serial port\n");
+
+  IOReturn status = serialStream->acquirePort(false);
   if (status != kIOReturnSuccess) {
+    SYSLOG("SerialMouse: Failed to acquire serial port with status 0x%X\n", status);
     return status;
   }
 
+  _serialStream = serialStream;
+  _serialStream->retain();
+  return status;
+}
+
+void SerialMouse::releasePort() {
+  DBGLOG("SerialMouse: Releasing serial port\n");
+
   //
-  // Ensure mouse ID byte is valid.
+  // Deactivate and release port.
   //
-  if (mouseId != MOUSE_ID_BYTE) {
-    return kIOReturnInvalid;
+  if (_serialStream != nullptr) {
+    if (_serialStream->executeEvent(PD_E_ACTIVE, false) == kIOReturnSuccess) {
+      _serialStream->releasePort();
+    }
   }
-  return kIOReturnSuccess;
+  OSSafeReleaseNULL(_serialStream);
 }
 
 IOReturn SerialMouse::getPortSettings(UInt32 *dataRate, UInt32 *dataSize, UInt32 *stopBits, UInt32 *flowControl) {
@@ -317,3 +1074,120 @@ IOReturn SerialMouse::setPortSettings(UInt32 dataRate, UInt32 dataSize, UInt32 s
   }
   return _serialStream->executeEvent(PD_E_FLOW_CONTROL, flowControl);
 }
+
+void SerialMouse::restorePortSettings() {
+  //
+  // Restore the line settings and modem lines saved when the port was acquired.
+  //
+  if (_serialStream != nullptr && _origSettingsSaved) {
+    setPortSettings(_origDataRate, _origDataSize, _origStopBits, _origFlowControl);
+  }
+}
+
+SerialMouseStatus SerialMouse::CoreAdapter::setLineSettings(uint32_t dataRate, uint32_t dataSize, uint32_t stopBits) {
+  DBGLOG("SerialMouse: Set line settings(%u,%u,%u)\n", dataRate, dataSize, stopBits);
+  IOReturn status;
+
+  status = owner->_serialStream->executeEvent(PD_E_DATA_RATE, dataRate bits);
+  if (status != kIOReturnSuccess) {
+    return status;
+  }
+  status = owner->_serialStream->executeEvent(PD_E_DATA_SIZE, dataSize bits);
+  if (status != kIOReturnSuccess) {
+    return status;
+  }
+  return owner->_serialStream->executeEvent(PD_RS232_E_STOP_BITS, stopBits bits);
+}
+
+SerialMouseStatus SerialMouse::CoreAdapter::setModemLines(bool rts, bool dtr) {
+  return owner->_serialStream->executeEvent(PD_E_FLOW_CONTROL, (rts ? PD_RS232_S_RTS : 0) | (dtr ? PD_RS232_S_DTR : 0));
+}
+
+SerialMouseStatus SerialMouse::CoreAdapter::setActive(bool active) {
+  if (owner->_serialStream == nullptr) {
+    return kIOReturnNotOpen;
+  }
+  return owner->_serialStream->executeEvent(PD_E_ACTIVE, active);
+}
+
+SerialMouseStatus SerialMouse::CoreAdapter::flushReceive() {
+  DBGLOG("SerialMouse: Flushing port\n");
+  return owner->_serialStream->executeEvent(PD_E_RXQ_FLUSH, 0);
+}
+
+SerialMouseStatus SerialMouse::CoreAdapter::readData(uint8_t *buffer, uint32_t size, uint32_t *count, uint32_t min) {
+  return owner->_serialStream->dequeueData(buffer, size, count, min);
+}
+
+SerialMouseStatus SerialMouse::CoreAdapter::writeData(const uint8_t *buffer, uint32_t size) {
+  UInt32 count = 0;
+  return owner->_serialStream->enqueueData(const_cast<UInt8 *>(buffer), size, &count, true);
+}
+
+SerialMouseStatus SerialMouse::CoreAdapter::waitForData(bool packet) {
+  //
+  // Negotiation reads the port directly. Received data is left to it until it completes.
+  //
+  IOLockLock(owner->_pollThreadLock);
+  while (owner->_negotiating && !owner->_core.isReceiveCancelled()) {
+    IOLockSleep(owner->_pollThreadLock, &owner->_negotiating, THREAD_UNINT);
+  }
+  IOLockUnlock(owner->_pollThreadLock);
+
+  //
+  // The high water state is set once a full packet is queued, otherwise wait for the queue to be non-empty.
+  //
+  UInt32 state = packet ? PD_S_RXQ_HIGH_WATER : 0;
+  UInt32 mask  = packet ? PD_S_RXQ_HIGH_WATER : PD_S_RXQ_EMPTY;
+  return owner->_serialStream->watchState(&state, mask);
+}
+
+SerialMouseStatus SerialMouse::CoreAdapter::setWakeupThreshold(uint32_t bytes) {
+  //
+  // The high water state is set once the queue holds more than the high watermark.
+  //
+  return owner->_serialStream->executeEvent(PD_E_RXQ_HIGH_WATER, bytes - 1);
+}
+
+void SerialMouse::CoreAdapter::sleep(uint32_t milliseconds) {
+  IOSleep(milliseconds);
+}
+
+uint64_t SerialMouse::CoreAdapter::getUptimeNs() {
+  uint64_t nowAbs;
+  uint64_t nowNs;
+
+  clock_get_uptime(&nowAbs);
+  absolutetime_to_nanoseconds(nowAbs, &nowNs);
+  return nowNs;
+}
+
+void SerialMouse::CoreAdapter::dispatchPointer(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs) {
+  //
+  // Convert the arrival time of the packet back to the absolute time base used by the HID system.
+  //
+  uint64_t timestampAbs;
+  AbsoluteTime timestamp;
+  nanoseconds_to_absolutetime(timestampNs, &timestampAbs);
+  AbsoluteTime_to_scalar(&timestamp) = timestampAbs;
+
+  //
+  // Dispatch pointer movement event.
+  //
+  owner->dispatchRelativePointerEvent(dx, dy, buttons, timestamp);
+
+  //
+  // Dispatch scroll wheel event. Wheel mice report positive deltas when scrolling down.
+  //
+  if (dz != 0) {
+    owner->dispatchScrollWheelEvent(-dz, 0, 0, timestamp);
+  }
+}
+
+void SerialMouse::CoreAdapter::receive(uint64_t wakeTimeNs, uint32_t wakeBytes) {
+  //
+  // The wakeup is recorded on the work loop with the data, the receive thread only waits.
+  //
+  owner->_commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, owner, &SerialMouse::handleReceiveData),
+                                 &wakeTimeNs, reinterpret_cast<void *>(static_cast<uintptr_t>(wakeBytes)));
+}
@@ -13,62 +13,81 @@
 #include <IOKit/IOTypes.h>
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOWorkLoop.h>
 
 #include <IOKit/hidsystem/IOHIPointing.h>
 #include <IOKit/serial/IOSerialStreamSync.h>
 #include <IOKit/serial/IORS232SerialStreamSync.h>
 
-// Debug logging.
-#if DEBUG
-#define DBGLOG(args...) IOLog(args)
-#else
-#define DBGLOG(args...) ;
-#endif
+#include <kern/thread_call.h>
+#include <mach/thread_policy.h>
+#include <mach/thread_act.h>
 
-#define SYSLOG(args...) IOLog(args)
+#include "SerialMouseCore.hpp"
+#include "SerialMouseScheduler.hpp"
 
 #define bits <<1
 
 //
-// Serial settings for MS protocol.
+// Receive queue size in packets.
 //
-#define MOUSE_DATA_RATE     (1200 bits)
-#define MOUSE_DATA_SIZE     (7 bits)
-#define MOUSE_STOP_BITS     (1 bits)
-#define MOUSE_FLOW_CONTROL  (PD_RS232_S_RTS | PD_RS232_S_DTR)
-#define MOUSE_ID_DELAY_MS   100
-#define MOUSE_ID_BYTE       0x4D // 'M'
+#define MOUSE_RXQ_PACKET_COUNT  32
 
-#define MOUSE_POLL_DELAY_MS 100
+//
+// Raw capture buffer size in bytes. Must be a power of two.
+//
+#define MOUSE_CAPTURE_SIZE      65536
 
-// HID buttons.
-#define HID_MOUSE_LEFTB     0x1
-#define HID_MOUSE_RIGHTB    0x2
+//
+// Time in byte times to wait for a Logitech extension byte after a packet, as it does not reach the packet watermark alone.
+//
+#define MOUSE_EXTENSION_WAIT_BYTES 2
 
 //
-// Serial mouse packet format:
+// Maximum time to wait for the receive thread to exit during shutdown.
+//
+#define MOUSE_THREAD_EXIT_TIMEOUT_MS 500
+
 //
-// 7  6  5  4  3  2  1  0
-// X  1  LB RB Y7 Y6 X7 X6
-// X  0  X5 X4 X3 X2 X1 X0
-// X  0  Y5 Y4 Y3 Y2 Y1 Y0
+// Receive thread scheduling. The time constraint policy is sized from the packet period.
 //
+#define MOUSE_THREAD_COMPUTATION_US 200
+#define MOUSE_THREAD_IMPORTANCE     10
+
+typedef enum {
+  kSerialMouseThreadPolicyDefault,
+  kSerialMouseThreadPolicyPrecedence,
+  kSerialMouseThreadPolicyTimeConstraint
+} SerialMouseThreadPolicy;
 
 //
-// Serial mouse packet stuff.
+// Personality properties.
 //
-#define MOUSE_PACKET_LENGTH     3
-#define MOUSE_PACKET_HEADER_BIT 0x40
-#define MOUSE_PACKET_LEFTB_BIT  0x20
-#define MOUSE_PACKET_RIGHTB_BIT 0x10
+#define kSerialMouseProtocolKey              "MouseProtocol"
+#define kSerialMouseProtocolNameMouseSystems "MouseSystems"
+#define kSerialMouseIdTimeoutKey             "MouseIdTimeout"
+#define kSerialMouseCoalesceThresholdKey     "CoalesceThreshold"
+#define kSerialMouseReportRateKey            "ReportRate"
+#define kSerialMouseThreadPolicyKey          "ReaderThreadPolicy"
+#define kSerialMouseThreadPolicyNameDefault        "Default"
+#define kSerialMouseThreadPolicyNamePrecedence     "Precedence"
+#define kSerialMouseThreadPolicyNameTimeConstraint "TimeConstraint"
+#define kSerialMouseSharedReaderKey          "SharedReader"
+#define kSerialMouseCaptureKey               "Capture"
+#define kSerialMouseTraceKey                 "Trace"
+#define kSerialMouseResetHistogramsKey       "ResetHistograms"
 
-#define MOUSE_PACKET_VALID(packet)      ((Boolean)(packet[0] & MOUSE_PACKET_HEADER_BIT))
-#define MOUSE_PACKET_LEFTB(packet)      ((Boolean)(packet[0] & MOUSE_PACKET_LEFTB_BIT))
-#define MOUSE_PACKET_RIGHTB(packet)     ((Boolean)(packet[0] & MOUSE_PACKET_RIGHTB_BIT))
-#define MOUSE_PACKET_BUTTONS(packet)    ((UInt32)((MOUSE_PACKET_LEFTB(packet) ? HID_MOUSE_LEFTB : 0) | \
-  (MOUSE_PACKET_RIGHTB(packet) ? HID_MOUSE_RIGHTB : 0)))
-#define MOUSE_PACKET_POSX(packet)       ((SInt8)((packet[1] & 0x3F) | ((packet[0] & 0x3) << 6)))
-#define MOUSE_PACKET_POSY(packet)       ((SInt8)((packet[2] & 0x3F) | ((packet[0] & 0xC) << 4)))
+//
+// Registry properties.
+//
+#define kSerialMouseIdResponseTimeKey        "MouseIdResponseTime"
+#define kSerialMouseDataRateKey              "MouseDataRate"
+#define kSerialMouseStatisticsKey            "SerialMouseStatistics"
+#define kSerialMouseCaptureDataKey           "SerialMouseCapture"
+#define kSerialMouseTraceDataKey             "SerialMouseTrace"
+#define kSerialMouseLatencyHistogramKey      "DispatchLatencyHistogram"
+#define kSerialMouseIntervalHistogramKey     "PacketIntervalHistogram"
+#define kSerialMouseWakeupHistogramKey       "WakeupLatencyHistogram"
 
 //
 // SerialMouseResources class. This is used to keep the kext in memory.
@@ -86,29 +105,158 @@ private:
   // Serial stream.
   //
   IOSerialStreamSync *_serialStream = nullptr;
+  UInt32 _origDataRate      = 0;
+  UInt32 _origDataSize      = 0;
+  UInt32 _origStopBits      = 0;
+  UInt32 _origFlowControl   = 0;
+  bool   _origSettingsSaved = false;
 
   //
-  // Polling thread.
+  // Mouse ID detection. The ID is processed as it arrives, bounded by a timer.
+  // All ports are identified in parallel.
+  //
+  IOWorkLoop         *_workLoop    = nullptr;
+  IOCommandGate      *_commandGate = nullptr;
+  IOTimerEventSource *_idTimer     = nullptr;
+  bool               _identifying  = false;
+  uint64_t           _idStartTime  = 0;
+  UInt32             _idTimeoutMs  = MOUSE_ID_TIMEOUT_MS;
+  void handleMouseIdData();
+  void handleMouseIdTimeout(IOTimerEventSource *sender);
+  void completeMouseId(IOReturn status);
+
   //
-  thread_t _pollThread = nullptr;
+  // Logitech data rate negotiation waits on the mouse for several hundred milliseconds, so it runs on a thread call
+  // instead of the work loop, which may be shared with other ports. Receiving is suspended until it completes.
+  // _negotiateRunning stays set until the call has returned, both are protected by _pollThreadLock.
+  //
+  thread_call_t _negotiateCall    = nullptr;
+  bool          _negotiating      = false;
+  bool          _negotiateRunning = false;
+  static void negotiateDataRate(thread_call_param_t param0, thread_call_param_t param1);
+  IOReturn handleNegotiateComplete();
+  void endNegotiation();
+
+  //
+  // HID registration is deferred until the mouse has identified itself.
+  //
+  bool _hidStarted = false;
+  IOReturn startMouse();
+
+  //
+  // Sleep/wake notifications. The mouse may have lost power during sleep, so it is reset and identified again
+  // after wake, which also negotiates the data rate and sends the report rate.
+  //
+  IONotifier          *_sleepWakeNotifier = nullptr;
+  SerialMouseProtocol _wakeProtocol       = kSerialMouseProtocolMicrosoft;
+  static IOReturn handleSleepWake(void *target, void *refCon, UInt32 messageType, IOService *provider,
+                                  void *messageArgument, vm_size_t argSize);
+  IOReturn handleWake();
+  IOReturn handleSetReportRate(void *reportRate);
+
+  //
+  // Receive thread. It runs the core receive loop, which only waits for data to arrive. The data is then drained
+  // in batches on the work loop. The thread exits on its own once the core cancels the loop by deactivating the port.
+  //
+  thread_t _pollThread        = nullptr;
+  IOLock   *_pollThreadLock   = nullptr;
+  bool     _pollThreadRunning = false;
   void pollMouseThread();
+  void stopPollThread();
+  IOReturn handleReceiveData(void *wakeTimeNs, void *wakeBytes);
+  IOReturn drainReceiveQueue(UInt32 maxReads);
+
+  //
+  // Shared reader. The port is polled from a shared work loop instead of its own receive thread.
+  //
+  SerialMouseScheduler *_scheduler = nullptr;
+  bool _sharedReader = false;
+  bool serviceReceive(UInt32 maxReads);
+  friend class SerialMouseScheduler;
+
+  //
+  // The time constraint policy is sized from the packet length and data rate it was last applied with.
+  //
+  SerialMouseThreadPolicy _threadPolicy = kSerialMouseThreadPolicyTimeConstraint;
+  uint64_t _threadPolicyByteTimeNs     = 0;
+  uint32_t _threadPolicyPacketLength   = 0;
+  void applyThreadPolicy();
+  void updateThreadPolicy();
+
+  //
+  // Sets the receive queue high watermark to a full packet when supported, so the thread can wake once per packet.
+  // A trailing extension byte is then collected by a short timer, which wakes the thread per byte if that leaves
+  // part of the next packet behind.
+  //
+  IOTimerEventSource *_extensionTimer = nullptr;
+  void setupReceiveQueue();
+  void handleExtensionTimeout(IOTimerEventSource *sender);
+
+  //
+  // Raw capture. Recording runs on the work loop, the lock keeps the buffer stable while it is published.
+  //
+  uint8_t *_captureBuffer = nullptr;
+  IOLock  *_captureLock   = nullptr;
+  IOReturn handleSetCapture(void *enable);
+
+  //
+  // Formatted trace and stopped capture returned by serializeProperties(). Each is only rebuilt once the trace
+  // has new records or another capture has been stopped, under _captureLock.
+  //
+  mutable OSArray  *_traceArray  = nullptr;
+  mutable uint32_t _traceHead    = 0;
+  mutable OSData   *_captureData = nullptr;
+
+  void updateTrace() const;
+  void updateCapture() const;
+  static void addHistogram(OSDictionary *properties, const char *key, const SerialMouseHistogram &histogram);
+  IOReturn handleResetHistograms();
+
+  //
+  // Core protocol handling. The adapter exposes the serial stream and HID event path to the core.
+  //
+  class CoreAdapter : public SerialMouseStream, public SerialMouseSink, public SerialMouseReceiver {
+  public:
+    SerialMouse *owner = nullptr;
+
+    virtual SerialMouseStatus setLineSettings(uint32_t dataRate, uint32_t dataSize, uint32_t stopBits) APPLE_KEXT_OVERRIDE;
+    virtual SerialMouseStatus setModemLines(bool rts, bool dtr) APPLE_KEXT_OVERRIDE;
+    virtual SerialMouseStatus setActive(bool active) APPLE_KEXT_OVERRIDE;
+    virtual SerialMouseStatus flushReceive() APPLE_KEXT_OVERRIDE;
+    virtual SerialMouseStatus readData(uint8_t *buffer, uint32_t size, uint32_t *count, uint32_t min) APPLE_KEXT_OVERRIDE;
+    virtual SerialMouseStatus writeData(const uint8_t *buffer, uint32_t size) APPLE_KEXT_OVERRIDE;
+    virtual SerialMouseStatus waitForData(bool packet) APPLE_KEXT_OVERRIDE;
+    virtual SerialMouseStatus setWakeupThreshold(uint32_t bytes) APPLE_KEXT_OVERRIDE;
+    virtual void sleep(uint32_t milliseconds) APPLE_KEXT_OVERRIDE;
+    virtual uint64_t getUptimeNs() APPLE_KEXT_OVERRIDE;
+    virtual void dispatchPointer(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs) APPLE_KEXT_OVERRIDE;
+    virtual void receive(uint64_t wakeTimeNs, uint32_t wakeBytes) APPLE_KEXT_OVERRIDE;
+  };
+
+  CoreAdapter     _coreAdapter;
+  SerialMouseCore _core;
 
   IOReturn acquirePort(IOSerialStreamSync *serialStream);
   void releasePort();
-  IOReturn setupPort();
-  IOReturn flushPort();
-  IOReturn checkMouseId();
 
   IOReturn getPortSettings(UInt32 *dataRate, UInt32 *dataSize, UInt32 *stopBits, UInt32 *flowControl);
   IOReturn setPortSettings(UInt32 dataRate, UInt32 dataSize, UInt32 stopBits, UInt32 flowControl);
+  void restorePortSettings();
 
 public:
   //
   // IOService overrides.
   //
+  virtual bool init(OSDictionary *dictionary) APPLE_KEXT_OVERRIDE;
   virtual IOService *probe(IOService *provider, SInt32 *score) APPLE_KEXT_OVERRIDE;
   virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
   virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+
+  //
+  // IORegistryEntry overrides.
+  //
+  virtual bool serializeProperties(OSSerialize *serialize) const APPLE_KEXT_OVERRIDE;
+  virtual IOReturn setProperties(OSObject *properties) APPLE_KEXT_OVERRIDE;
 };
 
 #endif
@@ -0,0 +1,115 @@
+//
+//  SerialMouseCapture.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#include "SerialMouseCapture.hpp"
+
+static void writeLE(uint8_t *output, uint32_t value, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    output[i] = (uint8_t) (value >> (i * 8));
+  }
+}
+
+static uint32_t readLE(const uint8_t *input, uint32_t count) {
+  uint32_t value = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    value |= (uint32_t) input[i] << (i * 8);
+  }
+  return value;
+}
+
+void SerialMouseCapture::attach(uint8_t *buffer, uint32_t size) {
+  _buffer     = buffer;
+  _size       = size;
+  _head       = 0;
+  _tail       = 0;
+  _lastTimeNs = 0;
+  _active     = false;
+}
+
+void SerialMouseCapture::detach() {
+  attach(nullptr, 0);
+}
+
+void SerialMouseCapture::restart() {
+  _head       = 0;
+  _tail       = 0;
+  _lastTimeNs = 0;
+}
+
+void SerialMouseCapture::record(const uint8_t *data, uint32_t length, uint64_t timeNs) {
+  if (!_active || length == 0) {
+    return;
+  }
+
+  //
+  // Split reads longer than a record can hold.
+  //
+  while (length > 0) {
+    uint32_t chunk  = length > MOUSE_CAPTURE_RECORD_MAX_DATA ? MOUSE_CAPTURE_RECORD_MAX_DATA : length;
+    uint32_t needed = MOUSE_CAPTURE_RECORD_SIZE + chunk;
+    if (needed > _size) {
+      return;
+    }
+
+    //
+    // Drop the oldest records to make room.
+    //
+    while (_size - getLength() < needed) {
+      _tail += MOUSE_CAPTURE_RECORD_SIZE + readByte(_tail + 4);
+    }
+
+    uint64_t deltaUs = (_lastTimeNs != 0 && timeNs > _lastTimeNs) ? (timeNs - _lastTimeNs) / 1000 : 0;
+    if (deltaUs > UINT32_MAX) {
+      deltaUs = UINT32_MAX;
+    }
+    _lastTimeNs = timeNs;
+
+    uint8_t recordHeader[MOUSE_CAPTURE_RECORD_SIZE];
+    writeLE(recordHeader, (uint32_t) deltaUs, 4);
+    recordHeader[4] = (uint8_t) chunk;
+    for (uint32_t i = 0; i < MOUSE_CAPTURE_RECORD_SIZE; i++) {
+      writeByte(recordHeader[i]);
+    }
+    for (uint32_t i = 0; i < chunk; i++) {
+      writeByte(data[i]);
+    }
+
+    data   += chunk;
+    length -= chunk;
+  }
+}
+
+size_t SerialMouseCapture::copyOut(uint8_t *output, size_t size, uint32_t protocol, uint32_t dataRate) const {
+  uint32_t length = getLength();
+
+  if (size < MOUSE_CAPTURE_HEADER_SIZE + length) {
+    return 0;
+  }
+
+  writeLE(&output[0], MOUSE_CAPTURE_MAGIC, 4);
+  writeLE(&output[4], MOUSE_CAPTURE_VERSION, 2);
+  writeLE(&output[6], protocol, 2);
+  writeLE(&output[8], dataRate, 4);
+  writeLE(&output[12], 0, 4);
+  for (uint32_t i = 0; i < length; i++) {
+    output[MOUSE_CAPTURE_HEADER_SIZE + i] = readByte(_tail + i);
+  }
+  return MOUSE_CAPTURE_HEADER_SIZE + length;
+}
+
+bool SerialMouseCapture::readHeader(const uint8_t *input, size_t size, SerialMouseCaptureHeader *header) {
+  if (size < MOUSE_CAPTURE_HEADER_SIZE) {
+    return false;
+  }
+
+  header->magic    = readLE(&input[0], 4);
+  header->version  = (uint16_t) readLE(&input[4], 2);
+  header->protocol = (uint16_t) readLE(&input[6], 2);
+  header->dataRate = readLE(&input[8], 4);
+  header->reserved = readLE(&input[12], 4);
+  return header->magic == MOUSE_CAPTURE_MAGIC && header->version == MOUSE_CAPTURE_VERSION;
+}
@@ -0,0 +1,68 @@
+//
+//  SerialMouseCapture.hpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#ifndef SerialMouseCapture_hpp
+#define SerialMouseCapture_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Raw stream capture format. All fields are little endian.
+//
+// The file starts with a header, followed by one record per read:
+//   uint32_t deltaUs   Time since the previous record, ignored for the first record.
+//   uint8_t  length    Number of bytes that follow.
+//   uint8_t  data[length]
+//
+#define MOUSE_CAPTURE_MAGIC           0x50434D53 // 'SMCP'
+#define MOUSE_CAPTURE_VERSION         1
+#define MOUSE_CAPTURE_HEADER_SIZE     16
+#define MOUSE_CAPTURE_RECORD_SIZE     5
+#define MOUSE_CAPTURE_RECORD_MAX_DATA 0xFF
+
+struct SerialMouseCaptureHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t protocol;
+  uint32_t dataRate;
+  uint32_t reserved;
+};
+
+//
+// Capture ring. Records are stored back to back and the oldest are dropped once the ring is full,
+// so the capture always holds the most recent data.
+// The buffer is owned by the caller and its size must be a power of two.
+//
+class SerialMouseCapture {
+private:
+  uint8_t  *_buffer          = nullptr;
+  uint32_t _size             = 0;
+  uint32_t _head             = 0;
+  uint32_t _tail             = 0;
+  uint64_t _lastTimeNs       = 0;
+  bool     _active           = false;
+
+  void writeByte(uint8_t value) { _buffer[_head++ & (_size - 1)] = value; }
+  uint8_t readByte(uint32_t offset) const { return _buffer[offset & (_size - 1)]; }
+
+public:
+  void attach(uint8_t *buffer, uint32_t size);
+  void detach();
+  void restart();
+
+  bool isActive() const { return _active; }
+  void setActive(bool active) { _active = active && _buffer != nullptr; }
+  uint32_t getLength() const { return _head - _tail; }
+
+  void record(const uint8_t *data, uint32_t length, uint64_t timeNs);
+  size_t copyOut(uint8_t *output, size_t size, uint32_t protocol, uint32_t dataRate) const;
+
+  static bool readHeader(const uint8_t *input, size_t size, SerialMouseCaptureHeader *header);
+};
+
+#endif
@@ -0,0 +1,642 @@
+//
+//  SerialMouseCore.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#include "SerialMouseCore.hpp"
+
+//
+// Logitech data rates, highest first.
+//
+static const struct {
+  uint32_t dataRate;
+  uint8_t  command;
+} kLogitechDataRates[] = {
+  { 9600, MOUSE_LOGI_CMD_9600 },
+  { 4800, MOUSE_LOGI_CMD_4800 },
+  { 2400, MOUSE_LOGI_CMD_2400 }
+};
+
+//
+// Logitech report rates, highest first.
+//
+static const struct {
+  uint32_t reportRate;
+  uint8_t  command;
+} kLogitechReportRates[] = {
+  { 150, MOUSE_LOGI_CMD_RATE_150 },
+  { 100, MOUSE_LOGI_CMD_RATE_100 },
+  { 70,  MOUSE_LOGI_CMD_RATE_70 },
+  { 50,  MOUSE_LOGI_CMD_RATE_50 },
+  { 35,  MOUSE_LOGI_CMD_RATE_35 },
+  { 20,  MOUSE_LOGI_CMD_RATE_20 },
+  { 10,  MOUSE_LOGI_CMD_RATE_10 }
+};
+
+void SerialMouseCore::attach(SerialMouseStream *stream, SerialMouseSink *sink) {
+  _stream = stream;
+  _sink   = sink;
+  reset();
+}
+
+void SerialMouseCore::reset() {
+  _ring.head = 0;
+  _ring.tail = 0;
+
+  _decodeState.extensionPending = false;
+  _decodeState.packetButtons    = 0;
+  _decodeState.middleButton     = 0;
+  _decodeState.discarding       = false;
+
+  _coalesced.pending = false;
+  _coalescing        = false;
+  _lastButtons       = 0;
+  _lastPacketTimeNs  = 0;
+}
+
+void SerialMouseCore::resetHistograms() {
+  _latencyHistogram  = { };
+  _intervalHistogram = { };
+  _wakeupHistogram   = { };
+}
+
+void SerialMouseCore::setProtocol(SerialMouseProtocol protocol) {
+  _protocol = protocol;
+  reset();
+}
+
+uint32_t SerialMouseCore::getPacketLength() const {
+  switch (_protocol) {
+    case kSerialMouseProtocolWheel:
+      return WheelProtocolTraits::kPacketLength;
+
+    case kSerialMouseProtocolLogitech:
+      return LogitechProtocolTraits::kPacketLength;
+
+    case kSerialMouseProtocolMouseSystems:
+      return MouseSystemsProtocolTraits::kPacketLength;
+
+    default:
+      return MicrosoftProtocolTraits::kPacketLength;
+  }
+}
+
+SerialMouseStatus SerialMouseCore::setupPort() {
+  DBGLOG("SerialMouse: Setting up port\n");
+  SerialMouseStatus status;
+
+  //
+  // Set up and activate port. Mouse Systems mice use 8 data bits, all others use 7.
+  //
+  if (_protocol == kSerialMouseProtocolMouseSystems) {
+    status = setLineSettings(MouseSystemsProtocolTraits::kDataRate, MouseSystemsProtocolTraits::kDataSize,
+                             MouseSystemsProtocolTraits::kStopBits);
+  } else {
+    status = setLineSettings(MicrosoftProtocolTraits::kDataRate, MicrosoftProtocolTraits::kDataSize,
+                             MicrosoftProtocolTraits::kStopBits);
+  }
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+  status = _stream->setModemLines(true, true);
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+  return _stream->setActive(true);
+}
+
+SerialMouseStatus SerialMouseCore::setLineSettings(uint32_t dataRate, uint32_t dataSize, uint32_t stopBits) {
+  //
+  // Each byte is framed by a start bit and the stop bits, with no parity.
+  //
+  _dataRate   = dataRate;
+  _byteTimeNs = (1 + dataSize + stopBits) * 1000000000ULL / dataRate;
+  return _stream->setLineSettings(dataRate, dataSize, stopBits);
+}
+
+SerialMouseStatus SerialMouseCore::setDataRate(uint32_t dataRate) {
+  //
+  // Keep the frame format of the protocol, only Logitech mice change their rate after setup.
+  //
+  if (_protocol == kSerialMouseProtocolMouseSystems) {
+    return setLineSettings(dataRate, MouseSystemsProtocolTraits::kDataSize, MouseSystemsProtocolTraits::kStopBits);
+  }
+  return setLineSettings(dataRate, MicrosoftProtocolTraits::kDataSize, MicrosoftProtocolTraits::kStopBits);
+}
+
+SerialMouseStatus SerialMouseCore::negotiateDataRate() {
+  SerialMouseStatus status;
+
+  //
+  // Only Logitech mice can change their data rate.
+  //
+  if (_protocol != kSerialMouseProtocolLogitech) {
+    return kSerialMouseSuccess;
+  }
+
+  //
+  // Try each rate from the highest down. A failed switch resets the mouse back to 1200 baud before the next one.
+  //
+  for (size_t i = 0; i < sizeof (kLogitechDataRates) / sizeof (kLogitechDataRates[0]); i++) {
+    status = setMouseDataRate(kLogitechDataRates[i].dataRate, kLogitechDataRates[i].command);
+    if (status == kSerialMouseSuccess) {
+      status = verifyMouseDataRate();
+    }
+    if (status == kSerialMouseSuccess) {
+      DBGLOG("SerialMouse: Negotiated data rate of %u\n", _dataRate);
+      break;
+    }
+
+    DBGLOG("SerialMouse: Mouse did not accept data rate of %u\n", kLogitechDataRates[i].dataRate);
+    status = resetMouseDataRate();
+    if (status != kSerialMouseSuccess) {
+      return status;
+    }
+  }
+
+  //
+  // Setting the report rate also returns the mouse to stream mode.
+  //
+  return applyReportRate();
+}
+
+SerialMouseStatus SerialMouseCore::applyReportRate() {
+  uint8_t command = MOUSE_LOGI_CMD_CONTINUOUS;
+
+  if (_protocol != kSerialMouseProtocolLogitech) {
+    return kSerialMouseSuccess;
+  }
+
+  //
+  // Use the highest supported rate not above the requested one.
+  //
+  if (_reportRate != MOUSE_REPORT_RATE_CONTINUOUS) {
+    size_t count = sizeof (kLogitechReportRates) / sizeof (kLogitechReportRates[0]);
+    command = kLogitechReportRates[count - 1].command;
+    for (size_t i = 0; i < count; i++) {
+      if (kLogitechReportRates[i].reportRate <= _reportRate) {
+        command = kLogitechReportRates[i].command;
+        break;
+      }
+    }
+  }
+
+  DBGLOG("SerialMouse: Setting report rate of %u with command 0x%X\n", _reportRate, command);
+  return _stream->writeData(&command, sizeof (command));
+}
+
+SerialMouseStatus SerialMouseCore::setMouseDataRate(uint32_t dataRate, uint8_t command) {
+  SerialMouseStatus status;
+  const uint8_t rateCommand[] = { MOUSE_LOGI_CMD_PREFIX, command };
+
+  //
+  // Send the command at the current rate and give it time to go out before switching the port.
+  //
+  status = _stream->writeData(rateCommand, sizeof (rateCommand));
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+  _stream->sleep(MOUSE_RATE_SWITCH_DELAY_MS);
+
+  return setLineSettings(dataRate, LogitechProtocolTraits::kDataSize, LogitechProtocolTraits::kStopBits);
+}
+
+SerialMouseStatus SerialMouseCore::verifyMouseDataRate() {
+  SerialMouseStatus status;
+  const uint8_t promptCommand[] = { MOUSE_LOGI_CMD_PROMPT };
+  const uint8_t pollCommand[]   = { MOUSE_LOGI_CMD_POLL };
+  uint8_t packet[LogitechProtocolTraits::kPacketLength + 1] = { };
+  uint32_t count = 0;
+
+  //
+  // Switch to prompt mode and request a single packet. It must be a complete packet starting with a header byte.
+  //
+  status = _stream->writeData(promptCommand, sizeof (promptCommand));
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+  _stream->sleep(MOUSE_RATE_VERIFY_DELAY_MS);
+  status = _stream->flushReceive();
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+
+  status = _stream->writeData(pollCommand, sizeof (pollCommand));
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+  _stream->sleep(MOUSE_RATE_VERIFY_DELAY_MS);
+  status = _stream->readData(packet, sizeof (packet), &count, 0);
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+
+  if (count < LogitechProtocolTraits::kPacketLength || !LogitechProtocolTraits::isHeader(packet[0])) {
+    return kSerialMouseInvalid;
+  }
+  for (uint32_t i = 1; i < LogitechProtocolTraits::kPacketLength; i++) {
+    if (LogitechProtocolTraits::isHeader(packet[i])) {
+      return kSerialMouseInvalid;
+    }
+  }
+  return kSerialMouseSuccess;
+}
+
+SerialMouseStatus SerialMouseCore::resetMouseDataRate() {
+  SerialMouseStatus status;
+
+  //
+  // Power cycling the mouse through DTR returns it to 1200 baud. The ID it sends again is discarded.
+  //
+  status = setLineSettings(LogitechProtocolTraits::kDataRate, LogitechProtocolTraits::kDataSize,
+                           LogitechProtocolTraits::kStopBits);
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+
+  status = _stream->setModemLines(true, false);
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+  status = _stream->setModemLines(true, true);
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+
+  _stream->sleep(MOUSE_ID_DELAY_MS);
+  return _stream->flushReceive();
+}
+
+SerialMouseStatus SerialMouseCore::checkMouseId() {
+  DBGLOG("SerialMouse: Checking mouse ID\n");
+  SerialMouseStatus status;
+
+  status = beginMouseId();
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+
+  //
+  // Wait the full ID delay and take whatever the mouse has sent.
+  //
+  _stream->sleep(MOUSE_ID_DELAY_MS);
+  status = receiveData(0);
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+  processRingBuffer();
+  return completeMouseId();
+}
+
+SerialMouseStatus SerialMouseCore::beginMouseId() {
+  SerialMouseStatus status;
+
+  //
+  // Flush receive buffer.
+  //
+  reset();
+  _idState = kSerialMouseIdPending;
+
+  //
+  // A capture only holds data of the protocol it is saved with, so a running one restarts with the new ID.
+  //
+  if (_capture.isActive()) {
+    _capture.restart();
+  }
+  status = _stream->flushReceive();
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+
+  //
+  // Toggle DTR bit. The mouse sends its ID once powered back up.
+  //
+  status = _stream->setModemLines(true, true);
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+  status = _stream->setModemLines(true, false);
+  if (status != kSerialMouseSuccess) {
+    return status;
+  }
+  return _stream->setModemLines(true, true);
+}
+
+SerialMouseStatus SerialMouseCore::completeMouseId() {
+  //
+  // Mice without an extension byte use the standard Microsoft protocol.
+  //
+  if (_idState == kSerialMouseIdExtensionPending) {
+    setProtocol(kSerialMouseProtocolMicrosoft);
+    _idState = kSerialMouseIdComplete;
+  } else if (_idState == kSerialMouseIdPending) {
+    _idState = kSerialMouseIdFailed;
+  }
+  return (_idState == kSerialMouseIdComplete) ? kSerialMouseSuccess : kSerialMouseInvalid;
+}
+
+void SerialMouseCore::resumeProtocol(SerialMouseProtocol protocol) {
+  //
+  // Decode with a previously identified protocol again, for a mouse that did not answer a repeated ID.
+  //
+  setProtocol(protocol);
+  _idState = kSerialMouseIdComplete;
+}
+
+void SerialMouseCore::processMouseId() {
+  while (_ring.used() > 0) {
+    uint8_t data = _ring.peek(0);
+
+    //
+    // Ensure mouse ID byte is valid, anything else is not a serial mouse.
+    //
+    if (_idState == kSerialMouseIdPending) {
+      DBGLOG("SerialMouse::processMouseId(): got ID byte 0x%X\n", data);
+      if (data != MOUSE_ID_BYTE) {
+        _idState = kSerialMouseIdFailed;
+        break;
+      }
+      _ring.consume(1);
+      _idState = kSerialMouseIdExtensionPending;
+      continue;
+    }
+
+    //
+    // Select the protocol from the extended ID. Remaining ID data is discarded.
+    //
+    if (_idState == kSerialMouseIdExtensionPending) {
+      DBGLOG("SerialMouse::processMouseId(): got extension byte 0x%X\n", data);
+      if (data == MOUSE_ID_WHEEL_BYTE) {
+        setProtocol(kSerialMouseProtocolWheel);
+      } else if (data == MOUSE_ID_LOGI_BYTE) {
+        setProtocol(kSerialMouseProtocolLogitech);
+      } else {
+        setProtocol(kSerialMouseProtocolMicrosoft);
+      }
+      _idState = kSerialMouseIdComplete;
+    }
+    break;
+  }
+
+  if (_idState == kSerialMouseIdFailed) {
+    _ring.consume(_ring.used());
+  }
+}
+
+SerialMouseStatus SerialMouseCore::receiveData(uint32_t min, uint32_t *bytesRead) {
+  SerialMouseStatus status;
+  uint32_t count = 0;
+
+  //
+  // Drain everything the stream has queued in a single call, blocking until at least min bytes are available.
+  //
+  status = _stream->readData(&_ring.buffer[_ring.head & MOUSE_RING_MASK], getRingReadSpan(), &count, min);
+  if (status != kSerialMouseSuccess) {
+    _stats.dequeueErrors++;
+    trace(kSerialMouseTraceReadError, (uint32_t) status);
+    return status;
+  }
+
+  if (count > 0) {
+    //
+    // ID bytes are not captured, a replay decodes everything it reads as packets.
+    //
+    _readTimeNs = _stream->getUptimeNs();
+    if (_idState == kSerialMouseIdComplete) {
+      _capture.record(&_ring.buffer[_ring.head & MOUSE_RING_MASK], count, _readTimeNs);
+    }
+    _ring.head       += count;
+    _stats.bytesRead += count;
+    trace(kSerialMouseTraceRead, count, _ring.used());
+
+    //
+    // The wait was satisfied once the byte it waited for arrived. Bytes read beyond that arrived while the reader was
+    // waking up, which dates the wait being satisfied to within a byte time.
+    //
+    if (_wakeBytes != 0 && count >= _wakeBytes) {
+      uint64_t satisfiedNs = getByteTime(_ring.head - count + _wakeBytes - 1);
+      _wakeupHistogram.record((_wakeTimeNs > satisfiedNs) ? _wakeTimeNs - satisfiedNs : 0);
+    }
+  }
+  _wakeBytes = 0;
+  if (bytesRead != nullptr) {
+    *bytesRead = count;
+  }
+  return kSerialMouseSuccess;
+}
+
+SerialMouseStatus SerialMouseCore::runReceiveLoop(SerialMouseReceiver *receiver) {
+  SerialMouseStatus status = kSerialMouseSuccess;
+
+  while (!isReceiveCancelled()) {
+    //
+    // Wait for a full packet when none is partially received, otherwise for the next byte so latency is never worse
+    // than waking per byte. The ID is always received per byte. An optional extension byte does not hold back
+    // packet wakeups, the driver collects it separately. This fails once the stream is deactivated.
+    //
+    bool packet = _packetWakeup && _idState == kSerialMouseIdComplete && !isPacketPending();
+    status = _stream->waitForData(packet);
+    if (status != kSerialMouseSuccess || isReceiveCancelled()) {
+      DBGLOG("SerialMouse: Receive loop exiting with status 0x%X\n", status);
+      break;
+    }
+    receiver->receive(_stream->getUptimeNs(), packet ? getPacketLength() : 1);
+  }
+  return status;
+}
+
+void SerialMouseCore::cancelReceive() {
+  //
+  // Deactivating the stream fails a pending wait or read, so the loop does not have to wait for more data to exit.
+  //
+  __atomic_store_n(&_receiveCancelled, true, __ATOMIC_RELEASE);
+  _stream->setActive(false);
+}
+
+uint32_t SerialMouseCore::getRingReadSpan() {
+  uint32_t used = _ring.used();
+
+  //
+  // Reset to the start of the buffer when empty so reads are not split at the wrap point.
+  //
+  if (used == 0) {
+    _ring.head = 0;
+    _ring.tail = 0;
+    return MOUSE_RING_SIZE;
+  }
+
+  //
+  // Only the contiguous free space up to the end of the buffer can be read into.
+  //
+  uint32_t span = MOUSE_RING_SIZE - (_ring.head & MOUSE_RING_MASK);
+  return (span < MOUSE_RING_SIZE - used) ? span : MOUSE_RING_SIZE - used;
+}
+
+template <typename Traits>
+void SerialMouseCore::decodeRingBuffer() {
+  uint32_t packetsDecoded = _stats.packetsDecoded;
+
+  //
+  // Coalesce motion if the reader has fallen behind.
+  //
+  _coalescing = _coalesceThreshold != 0 && (_ring.used() / Traits::kPacketLength) > _coalesceThreshold;
+  if (_coalescing) {
+    trace(kSerialMouseTraceCoalesce, _ring.used() / Traits::kPacketLength);
+  }
+  PacketDecoder<Traits>::decode(_ring, _decodeState, _stats, *this);
+  flushCoalesced();
+
+  updatePacketRate(_stats.packetsDecoded - packetsDecoded);
+}
+
+void SerialMouseCore::updatePacketRate(uint32_t packetCount) {
+  //
+  // Measure over windows that start with the first packet, so idle time before motion is not counted.
+  // Windows that ran into a pause in motion are discarded.
+  //
+  if (packetCount == 0) {
+    return;
+  }
+  if (_packetRateWindowCount == 0 || _readTimeNs - _packetRateWindowStart > 2 * MOUSE_PACKET_RATE_WINDOW_NS) {
+    _packetRateWindowStart = _readTimeNs;
+    _packetRateWindowCount = 0;
+  }
+  _packetRateWindowCount += packetCount;
+
+  uint64_t elapsedNs = _readTimeNs - _packetRateWindowStart;
+  if (elapsedNs >= MOUSE_PACKET_RATE_WINDOW_NS) {
+    _stats.packetRate      = (uint32_t) ((_packetRateWindowCount - packetCount) * 1000000000ULL / elapsedNs);
+    _packetRateWindowStart = _readTimeNs;
+    _packetRateWindowCount = packetCount;
+  }
+}
+
+void SerialMouseCore::processRingBuffer() {
+  //
+  // Data received before the mouse has identified itself is the ID.
+  //
+  if (_idState != kSerialMouseIdComplete) {
+    processMouseId();
+    return;
+  }
+
+  //
+  // Select the decoder once per read, each one is specialized for its protocol.
+  //
+  switch (_protocol) {
+    case kSerialMouseProtocolWheel:
+      decodeRingBuffer<WheelProtocolTraits>();
+      break;
+
+    case kSerialMouseProtocolLogitech:
+      decodeRingBuffer<LogitechProtocolTraits>();
+      break;
+
+    case kSerialMouseProtocolMouseSystems:
+      decodeRingBuffer<MouseSystemsProtocolTraits>();
+      break;
+
+    default:
+      decodeRingBuffer<MicrosoftProtocolTraits>();
+      break;
+  }
+
+  //
+  // Wait for full packets again once a partial packet left by the driver has been completed.
+  //
+  if (_partialWakeup && !isPacketPending()) {
+    _partialWakeup = false;
+    _stream->setWakeupThreshold(getPacketLength());
+  }
+}
+
+void SerialMouseCore::releasePartialPacket() {
+  //
+  // Data drained outside of the receive loop, such as while collecting an extension byte, can leave part of the next
+  // packet in the ring. The rest of it never reaches the packet watermark by itself, so the loop, which may already
+  // be waiting for a full packet, is woken by the next byte instead.
+  //
+  if (_packetWakeup && !_partialWakeup && _idState == kSerialMouseIdComplete && isPacketPending()) {
+    _partialWakeup = _stream->setWakeupThreshold(1) == kSerialMouseSuccess;
+  }
+}
+
+uint64_t SerialMouseCore::getByteTime(uint32_t index) const {
+  uint64_t lineTimeNs = (_ring.head - 1 - index) * _byteTimeNs;
+  return (lineTimeNs < _readTimeNs) ? _readTimeNs - lineTimeNs : 0;
+}
+
+void SerialMouseCore::dispatchPacket(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint32_t index) {
+  uint64_t packetTimeNs = getByteTime(index);
+
+  trace(kSerialMouseTracePacket, ((uint32_t) dx & 0xFFFF) | ((uint32_t) dy << 16), buttons);
+  if (_lastPacketTimeNs != 0 && packetTimeNs > _lastPacketTimeNs) {
+    _intervalHistogram.record(packetTimeNs - _lastPacketTimeNs);
+  }
+  _lastPacketTimeNs = packetTimeNs;
+
+  //
+  // Drop packets without motion that repeat the current button state, such as those sent while a button is held.
+  //
+  if (dx == 0 && dy == 0 && dz == 0 && buttons == _lastButtons) {
+    _stats.nullPacketsSuppressed++;
+    trace(kSerialMouseTraceSuppressed, buttons);
+    return;
+  }
+  _lastButtons = buttons;
+
+  if (!_coalescing) {
+    sendPointer(dx, dy, dz, buttons, packetTimeNs);
+    return;
+  }
+
+  //
+  // Sum motion while the button state is unchanged. Button transitions flush the pending event so no clicks are lost.
+  // The event keeps the time of its first packet, so latency is measured from the oldest motion it carries.
+  //
+  if (_coalesced.pending && _coalesced.buttons == buttons) {
+    _coalesced.dx += dx;
+    _coalesced.dy += dy;
+    _coalesced.dz += dz;
+    _stats.coalescedPackets++;
+    return;
+  }
+
+  flushCoalesced();
+  _coalesced.pending     = true;
+  _coalesced.dx          = dx;
+  _coalesced.dy          = dy;
+  _coalesced.dz          = dz;
+  _coalesced.buttons     = buttons;
+  _coalesced.timestampNs = packetTimeNs;
+}
+
+void SerialMouseCore::flushCoalesced() {
+  if (_coalesced.pending) {
+    _coalesced.pending = false;
+    sendPointer(_coalesced.dx, _coalesced.dy, _coalesced.dz, _coalesced.buttons, _coalesced.timestampNs);
+  }
+}
+
+void SerialMouseCore::sendPointer(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs) {
+  _stats.eventsDispatched++;
+  _sink->dispatchPointer(dx, dy, dz, buttons, timestampNs);
+
+  //
+  // Measure latency from the header byte arriving, and from the reader waking up, until the event has been handed to the sink.
+  //
+  uint64_t nowNs = _stream->getUptimeNs();
+  if (nowNs > timestampNs) {
+    _latencyHistogram.record(nowNs - timestampNs);
+  }
+  if (_wakeTimeNs != 0) {
+    uint32_t latencyUs = (uint32_t) ((nowNs - _wakeTimeNs) / 1000);
+    _stats.dispatchLatencyUs = latencyUs;
+    if (latencyUs > _stats.maxDispatchLatencyUs) {
+      _stats.maxDispatchLatencyUs = latencyUs;
+    }
+  }
+  trace(kSerialMouseTraceDispatch, _stats.dispatchLatencyUs, buttons);
+}
@@ -0,0 +1,322 @@
+//
+//  SerialMouseCore.hpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#ifndef SerialMouseCore_hpp
+#define SerialMouseCore_hpp
+
+//
+// The core only depends on the C standard headers so it can be built outside of the kernel.
+//
+#include <stdint.h>
+#include <stddef.h>
+
+#include "SerialMouseDecoder.hpp"
+#include "SerialMouseCapture.hpp"
+#include "SerialMouseTrace.hpp"
+
+#ifdef KERNEL
+#include <IOKit/IOLib.h>
+#define SERIALMOUSE_LOG(args...) IOLog(args)
+#else
+#include <stdio.h>
+#define SERIALMOUSE_LOG(args...) printf(args)
+#endif
+
+// Debug logging.
+#if DEBUG
+#define DBGLOG(args...) SERIALMOUSE_LOG(args)
+#else
+#define DBGLOG(args...) ;
+#endif
+
+#define SYSLOG(args...) SERIALMOUSE_LOG(args)
+
+//
+// Status codes. These match the equivalent IOReturn values.
+//
+typedef int32_t SerialMouseStatus;
+#define kSerialMouseSuccess 0
+#define kSerialMouseInvalid ((SerialMouseStatus) 0xE00002F0)
+
+//
+// Mouse ID.
+//
+#define MOUSE_ID_DELAY_MS      100
+#define MOUSE_ID_TIMEOUT_MS    500
+#define MOUSE_ID_EXT_DELAY_MS  20
+#define MOUSE_ID_BYTE          0x4D // 'M'
+#define MOUSE_ID_WHEEL_BYTE    0x5A // 'Z'
+#define MOUSE_ID_LOGI_BYTE     0x33 // '3'
+
+//
+// Logitech commands. Data rate commands are prefixed with '*'.
+//
+#define MOUSE_LOGI_CMD_PREFIX     0x2A // '*'
+#define MOUSE_LOGI_CMD_1200       0x6E // 'n'
+#define MOUSE_LOGI_CMD_2400       0x6F // 'o'
+#define MOUSE_LOGI_CMD_4800       0x70 // 'p'
+#define MOUSE_LOGI_CMD_9600       0x71 // 'q'
+#define MOUSE_LOGI_CMD_PROMPT     0x44 // 'D'
+#define MOUSE_LOGI_CMD_POLL       0x50 // 'P'
+#define MOUSE_LOGI_CMD_RATE_10    0x4A // 'J'
+#define MOUSE_LOGI_CMD_RATE_20    0x4B // 'K'
+#define MOUSE_LOGI_CMD_RATE_35    0x4C // 'L'
+#define MOUSE_LOGI_CMD_RATE_50    0x52 // 'R'
+#define MOUSE_LOGI_CMD_RATE_70    0x4D // 'M'
+#define MOUSE_LOGI_CMD_RATE_100   0x51 // 'Q'
+#define MOUSE_LOGI_CMD_RATE_150   0x4E // 'N'
+#define MOUSE_LOGI_CMD_CONTINUOUS 0x4F // 'O'
+
+#define MOUSE_RATE_SWITCH_DELAY_MS  100
+#define MOUSE_RATE_VERIFY_DELAY_MS  50
+
+//
+// Report rate in reports per second. Continuous reporting sends packets even without motion.
+//
+#define MOUSE_REPORT_RATE_DEFAULT     150
+#define MOUSE_REPORT_RATE_CONTINUOUS  0
+
+//
+// Packet rate measurement window.
+//
+#define MOUSE_PACKET_RATE_WINDOW_NS   1000000000ULL
+
+//
+// Motion is coalesced when more than this many complete packets are buffered.
+//
+#define MOUSE_COALESCE_THRESHOLD 4
+
+//
+// Mouse ID detection state. The extension byte is optional and only waited on briefly.
+//
+typedef enum {
+  kSerialMouseIdComplete,
+  kSerialMouseIdPending,
+  kSerialMouseIdExtensionPending,
+  kSerialMouseIdFailed
+} SerialMouseIdState;
+
+//
+// Serial stream interface used by the core.
+//
+class SerialMouseStream {
+public:
+  virtual SerialMouseStatus setLineSettings(uint32_t dataRate, uint32_t dataSize, uint32_t stopBits) = 0;
+  virtual SerialMouseStatus setModemLines(bool rts, bool dtr) = 0;
+  virtual SerialMouseStatus setActive(bool active) = 0;
+  virtual SerialMouseStatus flushReceive() = 0;
+  virtual SerialMouseStatus readData(uint8_t *buffer, uint32_t size, uint32_t *count, uint32_t min) = 0;
+  virtual SerialMouseStatus writeData(const uint8_t *buffer, uint32_t size) = 0;
+
+  //
+  // Blocks until data is queued, or a full packet when packet is set. Fails once the stream is deactivated.
+  //
+  virtual SerialMouseStatus waitForData(bool packet) = 0;
+
+  //
+  // Sets the number of queued bytes that satisfies a wait for a full packet, waking a thread already blocked on it.
+  //
+  virtual SerialMouseStatus setWakeupThreshold(uint32_t bytes) = 0;
+  virtual void sleep(uint32_t milliseconds) = 0;
+  virtual uint64_t getUptimeNs() = 0;
+
+protected:
+  ~SerialMouseStream() { }
+};
+
+//
+// Pointer sink interface used by the core to report decoded events.
+//
+class SerialMouseSink {
+public:
+  virtual void dispatchPointer(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs) = 0;
+
+protected:
+  ~SerialMouseSink() { }
+};
+
+//
+// Handles data once the receive loop has been woken, on whatever context the driver processes data on.
+// The time the loop was woken and the number of queued bytes it waited for are passed to markWakeup() there,
+// so that only that context writes the trace and the wakeup measurement.
+//
+class SerialMouseReceiver {
+public:
+  virtual void receive(uint64_t wakeTimeNs, uint32_t wakeBytes) = 0;
+
+protected:
+  ~SerialMouseReceiver() { }
+};
+
+//
+// Serial mouse protocol handling, independent of IOKit.
+//
+class SerialMouseCore {
+private:
+  SerialMouseStream *_stream = nullptr;
+  SerialMouseSink   *_sink   = nullptr;
+
+  //
+  // Active protocol, selected from the mouse ID.
+  //
+  SerialMouseProtocol _protocol = kSerialMouseProtocolMicrosoft;
+  SerialMouseIdState  _idState  = kSerialMouseIdComplete;
+
+  //
+  // Receive ring buffer and decoder state.
+  //
+  SerialMouseRing        _ring        = { };
+  SerialMouseDecodeState _decodeState = { };
+  SerialMouseStatistics  _stats       = { };
+
+  //
+  // Time from header byte arrival until dispatch returns, time between packets, and the estimated time from the
+  // receive loop wait being satisfied until the reader ran.
+  //
+  SerialMouseHistogram _latencyHistogram  = { };
+  SerialMouseHistogram _intervalHistogram = { };
+  SerialMouseHistogram _wakeupHistogram   = { };
+  uint64_t             _lastPacketTimeNs  = 0;
+
+  //
+  // Raw capture of received data, only recorded while a capture buffer is attached and active.
+  //
+  SerialMouseCapture _capture;
+
+  //
+  // Binary trace of the receive path, enabled at runtime.
+  //
+  SerialMouseTrace _trace;
+
+  //
+  // Time the newest byte in the ring was read, and the line time of a single byte.
+  // Bytes are assumed to have arrived back to back, so earlier bytes are dated from the newest one.
+  //
+  uint64_t _readTimeNs = 0;
+  uint64_t _byteTimeNs = 0;
+  uint32_t _dataRate   = 0;
+
+  //
+  // Time the reader was woken for the data being processed, and the number of queued bytes the receive loop
+  // waited for. The latter is cleared once the first read after the wakeup has been measured.
+  //
+  uint64_t _wakeTimeNs = 0;
+  uint32_t _wakeBytes  = 0;
+
+  //
+  // Requested report rate, and the packet rate measurement window.
+  //
+  uint32_t _reportRate            = MOUSE_REPORT_RATE_DEFAULT;
+  uint64_t _packetRateWindowStart = 0;
+  uint32_t _packetRateWindowCount = 0;
+
+  //
+  // Coalesced motion. Packets with the same button state are summed while the reader is behind.
+  //
+  struct {
+    bool     pending;
+    int32_t  dx;
+    int32_t  dy;
+    int32_t  dz;
+    uint32_t buttons;
+    uint64_t timestampNs;
+  } _coalesced = { };
+  uint32_t _coalesceThreshold = MOUSE_COALESCE_THRESHOLD;
+  bool     _coalescing        = false;
+
+  //
+  // Button state of the last accepted packet, used to drop packets that report nothing new.
+  //
+  uint32_t _lastButtons = 0;
+
+  //
+  // Receive loop. Cancellation is requested from another thread, packet wakeups are used once the stream supports them.
+  // The wakeup threshold is lowered to a single byte while a partial packet left by the driver is completed.
+  //
+  bool _receiveCancelled = false;
+  bool _packetWakeup     = false;
+  bool _partialWakeup    = false;
+
+  template <typename Traits>
+  friend class PacketDecoder;
+
+  uint32_t getRingReadSpan();
+  void processMouseId();
+  template <typename Traits>
+  void decodeRingBuffer();
+  void flushCoalesced();
+  void updatePacketRate(uint32_t packetCount);
+  void trace(uint16_t event, uint32_t arg0 = 0, uint32_t arg1 = 0) {
+    if (_trace.isEnabled()) {
+      _trace.record(event, _stream->getUptimeNs(), arg0, arg1);
+    }
+  }
+  void sendPointer(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs);
+  SerialMouseStatus setLineSettings(uint32_t dataRate, uint32_t dataSize, uint32_t stopBits);
+  uint64_t getByteTime(uint32_t index) const;
+  SerialMouseStatus setMouseDataRate(uint32_t dataRate, uint8_t command);
+  SerialMouseStatus verifyMouseDataRate();
+  SerialMouseStatus resetMouseDataRate();
+  void dispatchPacket(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint32_t index);
+
+public:
+  void attach(SerialMouseStream *stream, SerialMouseSink *sink);
+  void reset();
+
+  SerialMouseProtocol getProtocol() const { return _protocol; }
+  uint32_t getPacketLength() const;
+  bool isPacketPending() const { return _ring.used() > 0; }
+  bool isExtensionPending() const { return _decodeState.extensionPending; }
+  const SerialMouseStatistics &getStatistics() const { return _stats; }
+  const SerialMouseHistogram &getLatencyHistogram() const { return _latencyHistogram; }
+  const SerialMouseHistogram &getIntervalHistogram() const { return _intervalHistogram; }
+  const SerialMouseHistogram &getWakeupHistogram() const { return _wakeupHistogram; }
+  void resetHistograms();
+  SerialMouseCapture &getCapture() { return _capture; }
+  const SerialMouseCapture &getCapture() const { return _capture; }
+  SerialMouseTrace &getTrace() { return _trace; }
+  const SerialMouseTrace &getTrace() const { return _trace; }
+  void setCoalesceThreshold(uint32_t threshold) { _coalesceThreshold = threshold; }
+  void setProtocol(SerialMouseProtocol protocol);
+
+  SerialMouseStatus setupPort();
+  SerialMouseStatus setDataRate(uint32_t dataRate);
+  SerialMouseStatus negotiateDataRate();
+  uint32_t getDataRate() const { return _dataRate; }
+  uint64_t getByteTimeNs() const { return _byteTimeNs; }
+  uint32_t getReportRate() const { return _reportRate; }
+  void setReportRate(uint32_t reportRate) { _reportRate = reportRate; }
+  SerialMouseStatus applyReportRate();
+  SerialMouseIdState getMouseIdState() const { return _idState; }
+  SerialMouseStatus checkMouseId();
+  SerialMouseStatus beginMouseId();
+  SerialMouseStatus completeMouseId();
+  void resumeProtocol(SerialMouseProtocol protocol);
+
+  void markWakeup(uint64_t wakeTimeNs, uint32_t wakeBytes) {
+    _wakeTimeNs = wakeTimeNs;
+    _wakeBytes  = wakeBytes;
+    if (_trace.isEnabled()) {
+      _trace.record(kSerialMouseTraceWakeup, wakeTimeNs, 0, 0);
+    }
+  }
+  void markWakeup() { markWakeup(_stream->getUptimeNs(), 0); }
+  SerialMouseStatus receiveData(uint32_t min, uint32_t *bytesRead = nullptr);
+  void processRingBuffer();
+  void releasePartialPacket();
+
+  void setPacketWakeup(bool packetWakeup) {
+    _packetWakeup  = packetWakeup;
+    _partialWakeup = false;
+  }
+  bool getPacketWakeup() const { return _packetWakeup; }
+  bool isReceiveCancelled() const { return __atomic_load_n(&_receiveCancelled, __ATOMIC_ACQUIRE); }
+  void cancelReceive();
+  SerialMouseStatus runReceiveLoop(SerialMouseReceiver *receiver);
+};
+
+#endif
@@ -0,0 +1,457 @@
+//
+//  SerialMouseDecoder.hpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#ifndef SerialMouseDecoder_hpp
+#define SerialMouseDecoder_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+// HID buttons.
+#define HID_MOUSE_LEFTB     0x1
+#define HID_MOUSE_RIGHTB    0x2
+#define HID_MOUSE_MIDDLEB   0x4
+
+//
+// Supported mouse protocols.
+//
+typedef enum {
+  kSerialMouseProtocolMicrosoft,
+  kSerialMouseProtocolWheel,
+  kSerialMouseProtocolLogitech,
+  kSerialMouseProtocolMouseSystems,
+
+  kSerialMouseProtocolCount
+} SerialMouseProtocol;
+
+//
+// Receive ring buffer size. Must be a power of two.
+//
+#define MOUSE_RING_SIZE     128
+#define MOUSE_RING_MASK     (MOUSE_RING_SIZE - 1)
+
+//
+// Receive ring buffer. Head and tail are free-running and masked on access.
+//
+struct SerialMouseRing {
+  uint8_t  buffer[MOUSE_RING_SIZE];
+  uint32_t head;
+  uint32_t tail;
+
+  uint32_t used() const { return head - tail; }
+  uint8_t peek(uint32_t offset) const { return buffer[(tail + offset) & MOUSE_RING_MASK]; }
+  void consume(uint32_t count) { tail += count; }
+};
+
+//
+// Decoder state carried between reads.
+//
+struct SerialMouseDecodeState {
+  //
+  // Logitech extension state. The extension byte may only follow a complete packet.
+  //
+  bool     extensionPending;
+  uint32_t packetButtons;
+  uint32_t middleButton;
+
+  //
+  // Set while discarding data bytes that have no header.
+  //
+  bool     discarding;
+};
+
+//
+// Runtime statistics. Only written by the polling thread, 32-bit counters so reads from other threads never tear.
+//
+struct SerialMouseStatistics {
+  uint32_t bytesRead;
+  uint32_t packetsDecoded;
+  uint32_t headerResyncs;
+  uint32_t droppedPartialPackets;
+  uint32_t dequeueErrors;
+  uint32_t eventsDispatched;
+  uint32_t coalescedPackets;
+  uint32_t nullPacketsSuppressed;
+
+  //
+  // Packets per second over the last complete measurement window.
+  //
+  uint32_t packetRate;
+
+  //
+  // Time from the reader waking up to an event being dispatched, in microseconds.
+  //
+  uint32_t dispatchLatencyUs;
+  uint32_t maxDispatchLatencyUs;
+};
+
+//
+// Log-bucketed time histogram. Bucket 0 counts times under 1 us, bucket n counts times from 2^(n-1) up to 2^n us,
+// and the last bucket also counts anything longer.
+//
+#define MOUSE_HISTOGRAM_BUCKETS 24
+
+struct SerialMouseHistogram {
+  uint32_t buckets[MOUSE_HISTOGRAM_BUCKETS];
+
+  void record(uint64_t timeNs) {
+    uint64_t timeUs = timeNs / 1000;
+    uint32_t bucket = (timeUs == 0) ? 0 : 64 - __builtin_clzll(timeUs);
+    buckets[(bucket < MOUSE_HISTOGRAM_BUCKETS) ? bucket : MOUSE_HISTOGRAM_BUCKETS - 1]++;
+  }
+};
+
+//
+// Microsoft serial mouse packet format:
+//
+// 7  6  5  4  3  2  1  0
+// X  1  LB RB Y7 Y6 X7 X6
+// X  0  X5 X4 X3 X2 X1 X0
+// X  0  Y5 Y4 Y3 Y2 Y1 Y0
+//
+// Header byte fields are unpacked into a single word, with the high X/Y bits already shifted into place:
+//
+// 31    24 23    16 15     8 7      0
+// 0        buttons  Y7 Y6 0  X7 X6 0
+//
+#define MOUSE_HEADER_X(header)        ((header) & 0xFF)
+#define MOUSE_HEADER_Y(header)        (((header) >> 8) & 0xFF)
+#define MOUSE_HEADER_BUTTONS(header)  ((header) >> 16)
+
+constexpr uint32_t computeMicrosoftHeader(uint8_t byte) {
+  return ((uint32_t)(byte & 0x3) << 6) | ((uint32_t)(byte & 0xC) << 12)
+    | ((uint32_t)(((byte & 0x20) ? HID_MOUSE_LEFTB : 0) | ((byte & 0x10) ? HID_MOUSE_RIGHTB : 0)) << 16);
+}
+
+//
+// Header lookup table, generated at compile time and indexed by the header byte. It is not used by default, as it has
+// not measured consistently faster than computing the fields, see TableHeaderTraits.
+//
+struct MicrosoftHeaderTable {
+  uint32_t entries[256];
+
+  constexpr MicrosoftHeaderTable() : entries() {
+    for (uint32_t i = 0; i < 256; i++) {
+      entries[i] = computeMicrosoftHeader((uint8_t)i);
+    }
+  }
+};
+
+constexpr MicrosoftHeaderTable kMicrosoftHeaderTable;
+
+struct MicrosoftProtocolTraits {
+  static constexpr SerialMouseProtocol kProtocol = kSerialMouseProtocolMicrosoft;
+
+  static constexpr uint32_t kDataRate = 1200;
+  static constexpr uint32_t kDataSize = 7;
+  static constexpr uint32_t kStopBits = 1;
+
+  static constexpr uint32_t kPacketLength     = 3;
+  static constexpr bool     kResyncOnHeader   = true;
+  static constexpr bool     kHasExtensionByte = false;
+  static constexpr bool     kUseHeaderTable   = false;
+
+  static constexpr uint8_t kHeaderBit = 0x40;
+
+  static constexpr bool isHeader(uint8_t byte) {
+    return (byte & kHeaderBit) != 0;
+  }
+
+  static constexpr uint32_t computeHeader(uint8_t byte) {
+    return computeMicrosoftHeader(byte);
+  }
+
+  static uint32_t lookupHeader(uint8_t byte) {
+    return kMicrosoftHeaderTable.entries[byte];
+  }
+
+  static constexpr uint32_t getButtons(uint32_t header, const uint8_t *) {
+    return MOUSE_HEADER_BUTTONS(header);
+  }
+
+  static constexpr int32_t getX(uint32_t header, const uint8_t *packet) {
+    return (int8_t)((packet[1] & 0x3F) | MOUSE_HEADER_X(header));
+  }
+
+  static constexpr int32_t getY(uint32_t header, const uint8_t *packet) {
+    return (int8_t)((packet[2] & 0x3F) | MOUSE_HEADER_Y(header));
+  }
+
+  static constexpr int32_t getZ(const uint8_t *) {
+    return 0;
+  }
+
+  static constexpr bool isExtensionByte(uint8_t) {
+    return false;
+  }
+
+  static constexpr uint32_t getExtensionButtons(uint8_t) {
+    return 0;
+  }
+};
+
+//
+// IntelliMouse wheel packets append a fourth byte:
+//
+// 7  6  5  4  3  2  1  0
+// X  0  0  MB Z3 Z2 Z1 Z0
+//
+struct WheelProtocolTraits : MicrosoftProtocolTraits {
+  static constexpr SerialMouseProtocol kProtocol = kSerialMouseProtocolWheel;
+
+  static constexpr uint32_t kPacketLength = 4;
+
+  static constexpr uint8_t kMiddleBit = 0x10;
+
+  static constexpr uint32_t getButtons(uint32_t header, const uint8_t *packet) {
+    return MOUSE_HEADER_BUTTONS(header) | ((packet[3] & kMiddleBit) ? HID_MOUSE_MIDDLEB : 0);
+  }
+
+  static constexpr int32_t getZ(const uint8_t *packet) {
+    return (int8_t)(packet[3] << 4) >> 4;
+  }
+};
+
+//
+// Logitech 3-button mice send an extra byte after a packet only when the middle button changes:
+//
+// 7  6  5  4  3  2  1  0
+// X  0  MB 0  0  0  0  0
+//
+struct LogitechProtocolTraits : MicrosoftProtocolTraits {
+  static constexpr SerialMouseProtocol kProtocol = kSerialMouseProtocolLogitech;
+
+  static constexpr bool kHasExtensionByte = true;
+
+  static constexpr uint8_t kMiddleBit = 0x20;
+
+  static constexpr bool isExtensionByte(uint8_t byte) {
+    return (byte & ~kMiddleBit) == 0;
+  }
+
+  static constexpr uint32_t getExtensionButtons(uint8_t byte) {
+    return (byte & kMiddleBit) ? HID_MOUSE_MIDDLEB : 0;
+  }
+};
+
+//
+// Mouse Systems packet format. Buttons are active low and Y increases upwards:
+//
+// 7  6  5  4  3  2  1  0
+// 1  0  0  0  0  LB MB RB
+// X7 X6 X5 X4 X3 X2 X1 X0
+// Y7 Y6 Y5 Y4 Y3 Y2 Y1 Y0
+// X7 X6 X5 X4 X3 X2 X1 X0
+// Y7 Y6 Y5 Y4 Y3 Y2 Y1 Y0
+//
+// Both deltas are summed so each packet results in a single event.
+//
+struct MouseSystemsProtocolTraits {
+  static constexpr SerialMouseProtocol kProtocol = kSerialMouseProtocolMouseSystems;
+
+  static constexpr uint32_t kDataRate = 1200;
+  static constexpr uint32_t kDataSize = 8;
+  static constexpr uint32_t kStopBits = 1;
+
+  static constexpr uint32_t kPacketLength     = 5;
+  static constexpr bool     kResyncOnHeader   = false;
+  static constexpr bool     kHasExtensionByte = false;
+  static constexpr bool     kUseHeaderTable   = false;
+
+  static constexpr uint8_t kSyncMask   = 0xF8;
+  static constexpr uint8_t kSync       = 0x80;
+  static constexpr uint8_t kLeftBit    = 0x4;
+  static constexpr uint8_t kMiddleBit  = 0x2;
+  static constexpr uint8_t kRightBit   = 0x1;
+
+  static constexpr bool isHeader(uint8_t byte) {
+    return (byte & kSyncMask) == kSync;
+  }
+
+  static constexpr uint32_t computeHeader(uint8_t byte) {
+    return ((byte & kLeftBit) ? 0 : HID_MOUSE_LEFTB) | ((byte & kRightBit) ? 0 : HID_MOUSE_RIGHTB)
+      | ((byte & kMiddleBit) ? 0 : HID_MOUSE_MIDDLEB);
+  }
+
+  static uint32_t lookupHeader(uint8_t byte) {
+    return computeHeader(byte);
+  }
+
+  static constexpr uint32_t getButtons(uint32_t header, const uint8_t *) {
+    return header;
+  }
+
+  static constexpr int32_t getX(uint32_t, const uint8_t *packet) {
+    return (int8_t)packet[1] + (int8_t)packet[3];
+  }
+
+  static constexpr int32_t getY(uint32_t, const uint8_t *packet) {
+    return -((int8_t)packet[2] + (int8_t)packet[4]);
+  }
+
+  static constexpr int32_t getZ(const uint8_t *) {
+    return 0;
+  }
+
+  static constexpr bool isExtensionByte(uint8_t) {
+    return false;
+  }
+
+  static constexpr uint32_t getExtensionButtons(uint8_t) {
+    return 0;
+  }
+};
+
+//
+// Selects the header lookup table instead of computing the header fields with masks and shifts.
+//
+template <typename Base>
+struct TableHeaderTraits : Base {
+  static constexpr bool kUseHeaderTable = true;
+};
+
+//
+// Packet decoder, specialized at compile time for each protocol.
+// Complete packets are removed from the ring and passed to output.dispatchPacket().
+//
+template <typename Traits>
+class PacketDecoder {
+public:
+  template <typename Output>
+  static void decode(SerialMouseRing &ring, SerialMouseDecodeState &state, SerialMouseStatistics &stats, Output &output) {
+    uint8_t packet[Traits::kPacketLength];
+
+    //
+    // Work on local copies of the ring position, decoder state and counters. Stores through the references may alias
+    // each other, which would otherwise force them to be written back and read again around every byte and dispatch.
+    //
+    const uint32_t         head           = ring.head;
+    uint32_t               tail           = ring.tail;
+    SerialMouseDecodeState current        = state;
+    uint32_t               packetsDecoded = 0;
+    uint32_t               headerResyncs  = 0;
+    uint32_t               droppedPackets = 0;
+
+    while (head != tail) {
+      //
+      // If we are expecting the first byte of the packet but did not receive it, discard byte.
+      //
+      uint32_t packetStart = tail;
+      packet[0] = ring.buffer[tail++ & MOUSE_RING_MASK];
+      if (!Traits::isHeader(packet[0])) {
+        //
+        // Extension byte directly following a packet. The packet itself was already dispatched.
+        // Any other byte is noise and must not change the middle button.
+        //
+        bool extension = Traits::kHasExtensionByte && current.extensionPending && Traits::isExtensionByte(packet[0]);
+        current.extensionPending = false;
+        if (extension) {
+          uint32_t middleButton = Traits::getExtensionButtons(packet[0]);
+          if (middleButton != current.middleButton) {
+            current.middleButton = middleButton;
+            output.dispatchPacket(0, 0, 0, current.packetButtons | current.middleButton, packetStart);
+          }
+        } else if (!current.discarding) {
+          current.discarding = true;
+          droppedPackets++;
+        }
+        continue;
+      }
+      current.extensionPending = false;
+      current.discarding       = false;
+
+      //
+      // Wait for the rest of the packet to arrive.
+      //
+      if (head - packetStart < Traits::kPacketLength) {
+        tail = packetStart;
+        break;
+      }
+
+      //
+      // A header byte within the packet means the previous packet was cut short, resync on it.
+      //
+      uint32_t packetSequence;
+      for (packetSequence = 1; packetSequence < Traits::kPacketLength; packetSequence++) {
+        packet[packetSequence] = ring.buffer[(packetStart + packetSequence) & MOUSE_RING_MASK];
+        if (Traits::kResyncOnHeader && Traits::isHeader(packet[packetSequence])) {
+          break;
+        }
+      }
+      tail = packetStart + packetSequence;
+      if (packetSequence < Traits::kPacketLength) {
+        headerResyncs++;
+        continue;
+      }
+      packetsDecoded++;
+
+      //
+      // Dispatch pointer movement event, timestamped from the header byte. Packets with an optional extension byte
+      // are dispatched right away with the last known extension button state.
+      //
+      uint32_t header = Traits::kUseHeaderTable ? Traits::lookupHeader(packet[0]) : Traits::computeHeader(packet[0]);
+
+      current.packetButtons    = Traits::getButtons(header, packet);
+      current.extensionPending = Traits::kHasExtensionByte;
+      output.dispatchPacket(Traits::getX(header, packet), Traits::getY(header, packet), Traits::getZ(packet),
+                            current.packetButtons | current.middleButton, packetStart);
+    }
+
+    ring.tail                    = tail;
+    state                        = current;
+    stats.packetsDecoded        += packetsDecoded;
+    stats.headerResyncs         += headerResyncs;
+    stats.droppedPartialPackets += droppedPackets;
+  }
+};
+
+//
+// Bit layout checks.
+//
+namespace SerialMouseDecoderTests {
+  constexpr uint8_t kMicrosoftPacket[]    = { 0x40 | 0x20 | 0x0E, 0x3F, 0x01 };
+  constexpr uint8_t kWheelPacket[]        = { 0x40 | 0x10, 0x01, 0x3F, 0x10 | 0x0F };
+  constexpr uint8_t kMouseSystemsPacket[] = { 0x80 | 0x02, 0x7F, 0x01, 0x01, 0xFE };
+
+  constexpr uint32_t kMicrosoftHeader    = MicrosoftProtocolTraits::computeHeader(kMicrosoftPacket[0]);
+  constexpr uint32_t kWheelHeader        = WheelProtocolTraits::computeHeader(kWheelPacket[0]);
+  constexpr uint32_t kMouseSystemsHeader = MouseSystemsProtocolTraits::computeHeader(kMouseSystemsPacket[0]);
+
+  static_assert(MicrosoftProtocolTraits::isHeader(kMicrosoftPacket[0]), "Microsoft header bit");
+  static_assert(!MicrosoftProtocolTraits::isHeader(kMicrosoftPacket[1]), "Microsoft data byte");
+  static_assert(MicrosoftProtocolTraits::getButtons(kMicrosoftHeader, kMicrosoftPacket) == HID_MOUSE_LEFTB, "Microsoft buttons");
+  static_assert(MicrosoftProtocolTraits::getX(kMicrosoftHeader, kMicrosoftPacket) == -65, "Microsoft X high bits");
+  static_assert(MicrosoftProtocolTraits::getY(kMicrosoftHeader, kMicrosoftPacket) == -63, "Microsoft Y high bits");
+
+  static_assert(kMicrosoftHeaderTable.entries[0x40] == 0, "Header table empty header");
+  static_assert(kMicrosoftHeaderTable.entries[0x6E] == kMicrosoftHeader, "Header table matches computed header");
+  static_assert(MOUSE_HEADER_BUTTONS(kMicrosoftHeaderTable.entries[0x70]) == (HID_MOUSE_LEFTB | HID_MOUSE_RIGHTB),
+                "Header table buttons");
+  static_assert(MOUSE_HEADER_X(kMicrosoftHeaderTable.entries[0x43]) == 0xC0, "Header table X high bits");
+  static_assert(MOUSE_HEADER_Y(kMicrosoftHeaderTable.entries[0x4C]) == 0xC0, "Header table Y high bits");
+
+  static_assert(WheelProtocolTraits::getButtons(kWheelHeader, kWheelPacket) == (HID_MOUSE_RIGHTB | HID_MOUSE_MIDDLEB),
+                "Wheel buttons");
+  static_assert(WheelProtocolTraits::getX(kWheelHeader, kWheelPacket) == 1, "Wheel X");
+  static_assert(WheelProtocolTraits::getY(kWheelHeader, kWheelPacket) == 63, "Wheel Y");
+  static_assert(WheelProtocolTraits::getZ(kWheelPacket) == -1, "Wheel Z sign extension");
+
+  static_assert(LogitechProtocolTraits::getExtensionButtons(0x20) == HID_MOUSE_MIDDLEB, "Logitech middle button");
+  static_assert(LogitechProtocolTraits::getExtensionButtons(0x00) == 0, "Logitech middle button release");
+  static_assert(LogitechProtocolTraits::isExtensionByte(0x20) && LogitechProtocolTraits::isExtensionByte(0x00)
+                && !LogitechProtocolTraits::isExtensionByte(0x21), "Logitech extension byte");
+  static_assert(LogitechProtocolTraits::kPacketLength == 3, "Logitech packet length");
+
+  static_assert(MouseSystemsProtocolTraits::isHeader(0x87) && !MouseSystemsProtocolTraits::isHeader(0x88), "Mouse Systems sync");
+  static_assert(MouseSystemsProtocolTraits::getButtons(kMouseSystemsHeader, kMouseSystemsPacket)
+                == (HID_MOUSE_LEFTB | HID_MOUSE_RIGHTB), "Mouse Systems active low buttons");
+  static_assert(MouseSystemsProtocolTraits::getX(kMouseSystemsHeader, kMouseSystemsPacket) == 128, "Mouse Systems summed X");
+  static_assert(MouseSystemsProtocolTraits::getY(kMouseSystemsHeader, kMouseSystemsPacket) == 1,
+                "Mouse Systems summed inverted Y");
+}
+
+#endif
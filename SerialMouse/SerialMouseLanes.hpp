@@ -0,0 +1,127 @@
+//
+//  SerialMouseLanes.hpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#ifndef SerialMouseLanes_hpp
+#define SerialMouseLanes_hpp
+
+#include <stdint.h>
+
+//
+// Shared reader pool. Ports are spread across a fixed number of lanes, each serviced from its own work loop
+// with one batch read per port per turn.
+//
+#define MOUSE_SCHEDULER_LANE_COUNT    2
+#define MOUSE_SCHEDULER_LANE_PORTS    32
+#define MOUSE_SCHEDULER_INTERVAL_MS   4
+#define MOUSE_SCHEDULER_READ_BUDGET   1
+
+//
+// The serial API has no notification for arriving data, so a lane whose ports are all idle keeps polling,
+// but backs off up to this interval. Any data or a newly added port returns it to the normal interval.
+//
+#define MOUSE_SCHEDULER_IDLE_INTERVAL_MS  32
+
+//
+// Lane assignment and servicing order, independent of IOKit so it can be tested on the host.
+// Callers serialize access to each lane, the driver does so on the lane work loop. Lane reservations
+// are made before the port has a work loop, callers serialize them separately with a single lock.
+//
+template <typename Port, uint32_t kLaneCount = MOUSE_SCHEDULER_LANE_COUNT,
+          uint32_t kLanePorts = MOUSE_SCHEDULER_LANE_PORTS>
+class SerialMouseLanes {
+private:
+  struct Lane {
+    Port     *ports[kLanePorts];
+    uint32_t portCount;
+    uint32_t nextPort;
+    uint32_t reserved;
+    uint32_t intervalMs;
+  };
+  Lane _lanes[kLaneCount] = { };
+
+public:
+  uint32_t getLaneCount() const { return kLaneCount; }
+  uint32_t getPortCount(uint32_t lane) const { return _lanes[lane].portCount; }
+  uint32_t getReservedCount(uint32_t lane) const { return _lanes[lane].reserved; }
+
+  //
+  // Reserve room on the lane with the fewest reservations. Returns the lane count if every lane is full.
+  //
+  uint32_t reserveLane() {
+    uint32_t selected = 0;
+    for (uint32_t i = 1; i < kLaneCount; i++) {
+      if (_lanes[i].reserved < _lanes[selected].reserved) {
+        selected = i;
+      }
+    }
+
+    if (_lanes[selected].reserved >= kLanePorts) {
+      return kLaneCount;
+    }
+    _lanes[selected].reserved++;
+    return selected;
+  }
+
+  void releaseLane(uint32_t lane) {
+    if (_lanes[lane].reserved > 0) {
+      _lanes[lane].reserved--;
+    }
+  }
+
+  bool addPort(uint32_t lane, Port *port) {
+    if (_lanes[lane].portCount >= kLanePorts) {
+      return false;
+    }
+    _lanes[lane].ports[_lanes[lane].portCount++] = port;
+    _lanes[lane].intervalMs = MOUSE_SCHEDULER_INTERVAL_MS;
+    return true;
+  }
+
+  bool removePort(uint32_t lane, Port *port) {
+    for (uint32_t i = 0; i < _lanes[lane].portCount; i++) {
+      if (_lanes[lane].ports[i] == port) {
+        _lanes[lane].ports[i] = _lanes[lane].ports[--_lanes[lane].portCount];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  //
+  // Service every port of a lane with a fixed read budget, starting from a different port each turn
+  // so that a busy port cannot delay the others. The service function returns whether the port had data.
+  // Returns the time until the next turn, or zero once the lane has no ports.
+  //
+  template <typename Service>
+  uint32_t service(uint32_t lane, Service service) {
+    Lane *current = &_lanes[lane];
+    bool active   = false;
+    if (current->portCount == 0) {
+      return 0;
+    }
+
+    uint32_t start = current->nextPort % current->portCount;
+    current->nextPort = start + 1;
+    for (uint32_t i = 0; i < current->portCount; i++) {
+      if (service(current->ports[(start + i) % current->portCount], (uint32_t) MOUSE_SCHEDULER_READ_BUDGET)) {
+        active = true;
+      }
+    }
+
+    if (active || current->intervalMs < MOUSE_SCHEDULER_INTERVAL_MS) {
+      current->intervalMs = MOUSE_SCHEDULER_INTERVAL_MS;
+    } else if (current->intervalMs < MOUSE_SCHEDULER_IDLE_INTERVAL_MS) {
+      current->intervalMs *= 2;
+      if (current->intervalMs > MOUSE_SCHEDULER_IDLE_INTERVAL_MS) {
+        current->intervalMs = MOUSE_SCHEDULER_IDLE_INTERVAL_MS;
+      }
+    }
+    return current->intervalMs;
+  }
+};
+
+#endif
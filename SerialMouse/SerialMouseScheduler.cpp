@@ -0,0 +1,230 @@
+//
+//  SerialMouseScheduler.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#include "SerialMouseScheduler.hpp"
+#include "SerialMouse.hpp"
+
+OSDefineMetaClassAndStructors(SerialMouseScheduler, OSObject)
+
+//
+// Shared scheduler and its user count. The lock is allocated when the kext is loaded and freed when it is unloaded.
+//
+static class SerialMouseSchedulerLock {
+public:
+  IOLock *lock;
+
+  SerialMouseSchedulerLock() : lock(IOLockAlloc()) { }
+  ~SerialMouseSchedulerLock() {
+    if (lock != nullptr) {
+      IOLockFree(lock);
+    }
+  }
+} gSharedLock;
+
+static SerialMouseScheduler *gSharedScheduler = nullptr;
+static uint32_t             gSharedUsers      = 0;
+
+SerialMouseScheduler *SerialMouseScheduler::acquireShared() {
+  SerialMouseScheduler *scheduler;
+
+  if (gSharedLock.lock == nullptr) {
+    return nullptr;
+  }
+
+  IOLockLock(gSharedLock.lock);
+  if (gSharedScheduler == nullptr) {
+    scheduler = OSTypeAlloc(SerialMouseScheduler);
+    if (scheduler != nullptr && !scheduler->init()) {
+      scheduler->release();
+      scheduler = nullptr;
+    }
+    gSharedScheduler = scheduler;
+  }
+
+  scheduler = gSharedScheduler;
+  if (scheduler != nullptr) {
+    gSharedUsers++;
+  }
+  IOLockUnlock(gSharedLock.lock);
+  return scheduler;
+}
+
+void SerialMouseScheduler::releaseShared() {
+  SerialMouseScheduler *scheduler = nullptr;
+
+  IOLockLock(gSharedLock.lock);
+  if (gSharedUsers > 0 && --gSharedUsers == 0) {
+    scheduler = gSharedScheduler;
+    gSharedScheduler = nullptr;
+  }
+  IOLockUnlock(gSharedLock.lock);
+
+  //
+  // The last user has removed its port, so the lane work loops can be stopped.
+  //
+  if (scheduler != nullptr) {
+    DBGLOG("SerialMouse: Freeing shared reader\n");
+    scheduler->release();
+  }
+}
+
+bool SerialMouseScheduler::init() {
+  if (!OSObject::init()) {
+    return false;
+  }
+  bzero(_lanes, sizeof (_lanes));
+
+  _reserveLock = IOLockAlloc();
+  if (_reserveLock == nullptr) {
+    SYSLOG("SerialMouse: Failed to create shared reader lock\n");
+    return false;
+  }
+
+  //
+  // Create work loop, command gate, and polling timer for each lane.
+  //
+  for (uint32_t i = 0; i < MOUSE_SCHEDULER_LANE_COUNT; i++) {
+    Lane *lane = &_lanes[i];
+
+    lane->workLoop = IOWorkLoop::workLoop();
+    if (lane->workLoop == nullptr) {
+      SYSLOG("SerialMouse: Failed to create shared work loop\n");
+      return false;
+    }
+
+    lane->commandGate = IOCommandGate::commandGate(this);
+    if (lane->commandGate == nullptr || lane->workLoop->addEventSource(lane->commandGate) != kIOReturnSuccess) {
+      SYSLOG("SerialMouse: Failed to create shared command gate\n");
+      return false;
+    }
+
+    lane->timer = IOTimerEventSource::timerEventSource(this,
+      OSMemberFunctionCast(IOTimerEventSource::Action, this, &SerialMouseScheduler::handleLaneTimeout));
+    if (lane->timer == nullptr || lane->workLoop->addEventSource(lane->timer) != kIOReturnSuccess) {
+      SYSLOG("SerialMouse: Failed to create shared polling timer\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+void SerialMouseScheduler::free() {
+  for (uint32_t i = 0; i < MOUSE_SCHEDULER_LANE_COUNT; i++) {
+    Lane *lane = &_lanes[i];
+
+    if (lane->workLoop != nullptr) {
+      if (lane->timer != nullptr) {
+        lane->timer->cancelTimeout();
+        lane->workLoop->removeEventSource(lane->timer);
+      }
+      if (lane->commandGate != nullptr) {
+        lane->workLoop->removeEventSource(lane->commandGate);
+      }
+    }
+    OSSafeReleaseNULL(lane->timer);
+    OSSafeReleaseNULL(lane->commandGate);
+    OSSafeReleaseNULL(lane->workLoop);
+  }
+  if (_reserveLock != nullptr) {
+    IOLockFree(_reserveLock);
+    _reserveLock = nullptr;
+  }
+  OSObject::free();
+}
+
+IOWorkLoop *SerialMouseScheduler::selectWorkLoop() {
+  uint32_t index;
+
+  IOLockLock(_reserveLock);
+  index = _ports.reserveLane();
+  IOLockUnlock(_reserveLock);
+
+  return index < MOUSE_SCHEDULER_LANE_COUNT ? _lanes[index].workLoop : nullptr;
+}
+
+void SerialMouseScheduler::releaseWorkLoop(IOWorkLoop *workLoop) {
+  Lane *lane = getLane(workLoop);
+  if (lane == nullptr) {
+    return;
+  }
+
+  IOLockLock(_reserveLock);
+  _ports.releaseLane((uint32_t) (lane - _lanes));
+  IOLockUnlock(_reserveLock);
+}
+
+IOReturn SerialMouseScheduler::addPort(SerialMouse *port, IOWorkLoop *workLoop) {
+  Lane *lane = getLane(workLoop);
+  if (lane == nullptr) {
+    return kIOReturnBadArgument;
+  }
+
+  return lane->commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this,
+                                                           &SerialMouseScheduler::handleAddPort), lane, port);
+}
+
+void SerialMouseScheduler::removePort(SerialMouse *port, IOWorkLoop *workLoop) {
+  Lane *lane = getLane(workLoop);
+  if (lane == nullptr) {
+    return;
+  }
+
+  //
+  // The port is removed on the lane work loop, so it is not being serviced once this returns.
+  //
+  lane->commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this,
+                                                    &SerialMouseScheduler::handleRemovePort), lane, port);
+}
+
+SerialMouseScheduler::Lane *SerialMouseScheduler::getLane(IOWorkLoop *workLoop) {
+  for (uint32_t i = 0; i < MOUSE_SCHEDULER_LANE_COUNT; i++) {
+    if (_lanes[i].workLoop == workLoop) {
+      return &_lanes[i];
+    }
+  }
+  return nullptr;
+}
+
+IOReturn SerialMouseScheduler::handleAddPort(Lane *lane, SerialMouse *port) {
+  uint32_t index = (uint32_t) (lane - _lanes);
+
+  if (!_ports.addPort(index, port)) {
+    return kIOReturnNoResources;
+  }
+
+  //
+  // Restart polling at the normal interval, the lane may have backed off while idle.
+  //
+  lane->timer->cancelTimeout();
+  lane->timer->setTimeoutMS(MOUSE_SCHEDULER_INTERVAL_MS);
+  return kIOReturnSuccess;
+}
+
+IOReturn SerialMouseScheduler::handleRemovePort(Lane *lane, SerialMouse *port) {
+  uint32_t index = (uint32_t) (lane - _lanes);
+
+  _ports.removePort(index, port);
+  if (_ports.getPortCount(index) == 0) {
+    lane->timer->cancelTimeout();
+  }
+  return kIOReturnSuccess;
+}
+
+void SerialMouseScheduler::handleLaneTimeout(IOTimerEventSource *sender) {
+  for (uint32_t i = 0; i < MOUSE_SCHEDULER_LANE_COUNT; i++) {
+    if (_lanes[i].timer != sender) {
+      continue;
+    }
+    uint32_t intervalMs = _ports.service(i, [](SerialMouse *port, uint32_t maxReads) {
+      return port->serviceReceive(maxReads);
+    });
+    if (intervalMs != 0) {
+      _lanes[i].timer->setTimeoutMS(intervalMs);
+    }
+    return;
+  }
+}
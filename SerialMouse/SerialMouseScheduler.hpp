@@ -0,0 +1,68 @@
+//
+//  SerialMouseScheduler.hpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#ifndef SerialMouseScheduler_hpp
+#define SerialMouseScheduler_hpp
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOWorkLoop.h>
+
+#include "SerialMouseLanes.hpp"
+
+class SerialMouse;
+
+class SerialMouseScheduler : public OSObject {
+  OSDeclareDefaultStructors(SerialMouseScheduler);
+
+private:
+  //
+  // Each lane runs on its own work loop, the ports of a lane are only changed and serviced on it.
+  //
+  struct Lane {
+    IOWorkLoop         *workLoop;
+    IOCommandGate      *commandGate;
+    IOTimerEventSource *timer;
+  };
+  Lane                          _lanes[MOUSE_SCHEDULER_LANE_COUNT];
+  SerialMouseLanes<SerialMouse> _ports;
+
+  //
+  // Ports starting at the same time reserve their lane under this lock, before they are added on the lane work loop.
+  //
+  IOLock *_reserveLock;
+
+  Lane *getLane(IOWorkLoop *workLoop);
+  void handleLaneTimeout(IOTimerEventSource *sender);
+  IOReturn handleAddPort(Lane *lane, SerialMouse *port);
+  IOReturn handleRemovePort(Lane *lane, SerialMouse *port);
+
+public:
+  //
+  // The shared scheduler is created by its first user and freed with its last one.
+  //
+  static SerialMouseScheduler *acquireShared();
+  static void releaseShared();
+
+  //
+  // OSObject overrides.
+  //
+  virtual bool init() APPLE_KEXT_OVERRIDE;
+  virtual void free() APPLE_KEXT_OVERRIDE;
+
+  //
+  // Reserves room for a port on the least busy lane and returns its work loop, or nullptr if every lane is full.
+  // The reservation is released with releaseWorkLoop() once the port has been removed.
+  //
+  IOWorkLoop *selectWorkLoop();
+  void releaseWorkLoop(IOWorkLoop *workLoop);
+  IOReturn addPort(SerialMouse *port, IOWorkLoop *workLoop);
+  void removePort(SerialMouse *port, IOWorkLoop *workLoop);
+};
+
+#endif
@@ -0,0 +1,88 @@
+//
+//  SerialMouseTrace.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#include "SerialMouseTrace.hpp"
+
+#ifdef KERNEL
+#include <IOKit/IOLib.h>
+#else
+#include <stdio.h>
+#endif
+
+uint32_t SerialMouseTrace::copyOut(SerialMouseTraceRecord *output, uint32_t count) const {
+  uint32_t head   = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+  uint32_t first  = (head > MOUSE_TRACE_COUNT) ? head - MOUSE_TRACE_COUNT : 0;
+  uint32_t copied = 0;
+
+  if (head - first > count) {
+    first = head - count;
+  }
+
+  //
+  // Copy records oldest first, skipping any that were overwritten while being copied.
+  //
+  for (uint32_t sequence = first + 1; sequence <= head; sequence++) {
+    const SerialMouseTraceRecord *record = &_records[(sequence - 1) & MOUSE_TRACE_MASK];
+
+    if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != sequence) {
+      continue;
+    }
+    output[copied] = *record;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&record->sequence, __ATOMIC_RELAXED) != sequence) {
+      continue;
+    }
+    output[copied].sequence = sequence;
+    copied++;
+  }
+  return copied;
+}
+
+size_t SerialMouseTrace::format(const SerialMouseTraceRecord &record, char *output, size_t size) {
+  unsigned long long timestampUs = record.timestampNs / 1000;
+  int length;
+
+  switch (record.event) {
+    case kSerialMouseTraceWakeup:
+      length = snprintf(output, size, "%llu wakeup", timestampUs);
+      break;
+
+    case kSerialMouseTraceRead:
+      length = snprintf(output, size, "%llu read %u buffered %u", timestampUs, record.arg0, record.arg1);
+      break;
+
+    case kSerialMouseTraceReadError:
+      length = snprintf(output, size, "%llu read error 0x%X", timestampUs, record.arg0);
+      break;
+
+    case kSerialMouseTracePacket:
+      length = snprintf(output, size, "%llu packet %d,%d buttons 0x%X", timestampUs,
+                        (int16_t) (record.arg0 & 0xFFFF), (int16_t) (record.arg0 >> 16), record.arg1);
+      break;
+
+    case kSerialMouseTraceSuppressed:
+      length = snprintf(output, size, "%llu suppressed buttons 0x%X", timestampUs, record.arg0);
+      break;
+
+    case kSerialMouseTraceCoalesce:
+      length = snprintf(output, size, "%llu coalescing %u packets", timestampUs, record.arg0);
+      break;
+
+    case kSerialMouseTraceDispatch:
+      length = snprintf(output, size, "%llu dispatch latency %u us buttons 0x%X", timestampUs, record.arg0, record.arg1);
+      break;
+
+    default:
+      length = snprintf(output, size, "%llu event %u 0x%X 0x%X", timestampUs, record.event, record.arg0, record.arg1);
+      break;
+  }
+
+  if (length < 0) {
+    return 0;
+  }
+  return ((size_t) length < size) ? (size_t) length : size - 1;
+}
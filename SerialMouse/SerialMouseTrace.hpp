@@ -0,0 +1,84 @@
+//
+//  SerialMouseTrace.hpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#ifndef SerialMouseTrace_hpp
+#define SerialMouseTrace_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Trace buffer size in records. Must be a power of two.
+//
+#define MOUSE_TRACE_COUNT 256
+#define MOUSE_TRACE_MASK  (MOUSE_TRACE_COUNT - 1)
+
+//
+// Trace events and their arguments.
+//
+typedef enum {
+  kSerialMouseTraceWakeup = 1,  // None
+  kSerialMouseTraceRead,        // Bytes read, bytes buffered
+  kSerialMouseTraceReadError,   // Status
+  kSerialMouseTracePacket,      // Motion (dx low 16 bits, dy high 16 bits), buttons
+  kSerialMouseTraceSuppressed,  // Buttons
+  kSerialMouseTraceCoalesce,    // Packets buffered
+  kSerialMouseTraceDispatch     // Latency in microseconds, buttons
+} SerialMouseTraceEvent;
+
+struct SerialMouseTraceRecord {
+  uint64_t timestampNs;
+  uint32_t sequence;
+  uint16_t event;
+  uint16_t reserved;
+  uint32_t arg0;
+  uint32_t arg1;
+};
+
+//
+// Fixed-size binary trace. Recording is a handful of stores by a single writer, records are formatted
+// later by a reader. Each record carries its sequence number so a reader can detect records overwritten
+// while they were being copied, without any locking on the writer side. The driver only records on its
+// work loop, the receive thread passes its wakeups there instead of recording them itself.
+//
+class SerialMouseTrace {
+private:
+  SerialMouseTraceRecord _records[MOUSE_TRACE_COUNT] = { };
+  uint32_t _head    = 0;
+  bool     _enabled = false;
+
+public:
+  bool isEnabled() const { return __atomic_load_n(&_enabled, __ATOMIC_RELAXED); }
+  void setEnabled(bool enabled) { __atomic_store_n(&_enabled, enabled, __ATOMIC_RELAXED); }
+
+  //
+  // Sequence number of the last record, so a reader can tell whether anything was recorded since its last copy.
+  //
+  uint32_t getHead() const { return __atomic_load_n(&_head, __ATOMIC_ACQUIRE); }
+
+  void record(uint16_t event, uint64_t timestampNs, uint32_t arg0, uint32_t arg1) {
+    uint32_t               sequence = _head + 1;
+    SerialMouseTraceRecord *record  = &_records[_head & MOUSE_TRACE_MASK];
+
+    //
+    // Invalidate the record while it is written, then publish it.
+    //
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->timestampNs = timestampNs;
+    record->event       = event;
+    record->arg0        = arg0;
+    record->arg1        = arg1;
+    __atomic_store_n(&record->sequence, sequence, __ATOMIC_RELEASE);
+    __atomic_store_n(&_head, sequence, __ATOMIC_RELEASE);
+  }
+
+  uint32_t copyOut(SerialMouseTraceRecord *output, uint32_t count) const;
+  static size_t format(const SerialMouseTraceRecord &record, char *output, size_t size);
+};
+
+#endif
@@ -0,0 +1,171 @@
+//
+//  FakeSerialStream.hpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#ifndef FakeSerialStream_hpp
+#define FakeSerialStream_hpp
+
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <ostream>
+#include <vector>
+
+#include "SerialMouseCore.hpp"
+
+//
+// Scripted serial stream and pointer sink. Queued data is returned in reads of up to readSize bytes,
+// and time only advances when sleeping or when a test moves it.
+//
+class FakeSerialStream : public SerialMouseStream, public SerialMouseSink {
+public:
+  struct Event {
+    int32_t  dx;
+    int32_t  dy;
+    int32_t  dz;
+    uint32_t buttons;
+    uint64_t timestampNs;
+
+    Event(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs = 0)
+      : dx(dx), dy(dy), dz(dz), buttons(buttons), timestampNs(timestampNs) { }
+
+    bool operator==(const Event &other) const {
+      return dx == other.dx && dy == other.dy && dz == other.dz && buttons == other.buttons;
+    }
+  };
+
+  std::vector<uint8_t>  data;
+  size_t                position  = 0;
+  uint32_t              readSize  = MOUSE_RING_SIZE;
+  uint64_t              nowNs     = 1000000000ULL;
+
+  std::vector<uint8_t>  written;
+  std::vector<uint32_t> dataRates;
+  std::vector<bool>     dtrStates;
+  std::vector<Event>    events;
+  std::vector<bool>     packetWaits;
+  std::vector<uint32_t> wakeupThresholds;
+  uint32_t              wakeupThreshold = 1;
+  uint32_t              reads     = 0;
+  uint32_t              flushes   = 0;
+  bool                  active    = false;
+
+  //
+  // Called for each byte written, so tests can answer commands like a mouse would.
+  //
+  std::function<void(FakeSerialStream &, uint8_t)> onWrite;
+
+  void queue(std::initializer_list<uint8_t> bytes) {
+    data.insert(data.end(), bytes);
+  }
+
+  size_t queued() const {
+    return data.size() - position;
+  }
+
+  virtual SerialMouseStatus setLineSettings(uint32_t dataRate, uint32_t dataSize, uint32_t stopBits) override {
+    dataRates.push_back(dataRate);
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus setModemLines(bool rts, bool dtr) override {
+    dtrStates.push_back(dtr);
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus setActive(bool state) override {
+    active = state;
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus flushReceive() override {
+    position = data.size();
+    flushes++;
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus readData(uint8_t *buffer, uint32_t size, uint32_t *count, uint32_t min) override {
+    *count = (uint32_t) std::min<size_t>(std::min(size, readSize), queued());
+    memcpy(buffer, data.data() + position, *count);
+    position += *count;
+    reads++;
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus writeData(const uint8_t *buffer, uint32_t size) override {
+    for (uint32_t i = 0; i < size; i++) {
+      written.push_back(buffer[i]);
+      if (onWrite) {
+        onWrite(*this, buffer[i]);
+      }
+    }
+    return kSerialMouseSuccess;
+  }
+
+  //
+  // Returns at once while enough data is queued, and otherwise fails where a port would block, which ends a receive loop.
+  // Packet waits are satisfied by any queued data until a wakeup threshold is set.
+  //
+  virtual SerialMouseStatus waitForData(bool packet) override {
+    packetWaits.push_back(packet);
+    return (active && queued() >= (packet ? wakeupThreshold : 1)) ? kSerialMouseSuccess : kSerialMouseInvalid;
+  }
+
+  virtual SerialMouseStatus setWakeupThreshold(uint32_t bytes) override {
+    wakeupThresholds.push_back(bytes);
+    wakeupThreshold = bytes;
+    return kSerialMouseSuccess;
+  }
+
+  virtual void sleep(uint32_t milliseconds) override {
+    nowNs += milliseconds * 1000000ULL;
+  }
+
+  virtual uint64_t getUptimeNs() override {
+    return nowNs;
+  }
+
+  virtual void dispatchPointer(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs) override {
+    events.push_back(Event(dx, dy, dz, buttons, timestampNs));
+  }
+};
+
+static inline void PrintTo(const FakeSerialStream::Event &event, std::ostream *os) {
+  *os << "{ " << event.dx << ", " << event.dy << ", " << event.dz << ", 0x" << std::hex << event.buttons << std::dec << " }";
+}
+
+//
+// Reads and decodes everything queued, the way the driver drains the port on its work loop after a wakeup.
+//
+class FakeReceiver : public SerialMouseReceiver {
+public:
+  SerialMouseCore &core;
+  uint32_t        wakeups = 0;
+
+  explicit FakeReceiver(SerialMouseCore &core) : core(core) { }
+
+  virtual void receive(uint64_t wakeTimeNs, uint32_t wakeBytes) override {
+    uint32_t count;
+
+    wakeups++;
+    core.markWakeup(wakeTimeNs, wakeBytes);
+    do {
+      if (core.receiveData(0, &count) != kSerialMouseSuccess) {
+        break;
+      }
+      core.processRingBuffer();
+    } while (count > 0);
+  }
+};
+
+static inline void drainFakeStream(SerialMouseCore &core, FakeSerialStream &stream) {
+  FakeReceiver receiver(core);
+
+  receiver.receive(stream.getUptimeNs(), 0);
+}
+
+#endif
@@ -0,0 +1,254 @@
+//
+//  SerialMouseCoreTests.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#include <gtest/gtest.h>
+
+#include "FakeSerialStream.hpp"
+
+class CoreTest : public ::testing::Test {
+protected:
+  FakeSerialStream stream;
+  SerialMouseCore  core;
+
+  void SetUp() override {
+    core.attach(&stream, &stream);
+    ASSERT_EQ(core.setupPort(), kSerialMouseSuccess);
+  }
+};
+
+//
+// Mouse ID.
+//
+TEST_F(CoreTest, MouseIdTogglesDtr) {
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+  EXPECT_EQ(stream.dtrStates, (std::vector<bool> { true, true, false, true }));
+  EXPECT_EQ(core.getMouseIdState(), kSerialMouseIdPending);
+}
+
+TEST_F(CoreTest, MouseIdMicrosoft) {
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+  stream.queue({ MOUSE_ID_BYTE });
+  drainFakeStream(core, stream);
+  EXPECT_EQ(core.getMouseIdState(), kSerialMouseIdExtensionPending);
+
+  EXPECT_EQ(core.completeMouseId(), kSerialMouseSuccess);
+  EXPECT_EQ(core.getProtocol(), kSerialMouseProtocolMicrosoft);
+}
+
+TEST_F(CoreTest, MouseIdWheel) {
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+  stream.queue({ MOUSE_ID_BYTE, MOUSE_ID_WHEEL_BYTE });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(core.getMouseIdState(), kSerialMouseIdComplete);
+  EXPECT_EQ(core.completeMouseId(), kSerialMouseSuccess);
+  EXPECT_EQ(core.getProtocol(), kSerialMouseProtocolWheel);
+}
+
+TEST_F(CoreTest, MouseIdLogitech) {
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+  stream.queue({ MOUSE_ID_BYTE, MOUSE_ID_LOGI_BYTE });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(core.completeMouseId(), kSerialMouseSuccess);
+  EXPECT_EQ(core.getProtocol(), kSerialMouseProtocolLogitech);
+}
+
+TEST_F(CoreTest, MouseIdIgnoresDataBeforeReset) {
+  stream.queue({ 0x40, 0x01, 0x02 });
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+  stream.queue({ MOUSE_ID_BYTE, MOUSE_ID_WHEEL_BYTE });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(core.getProtocol(), kSerialMouseProtocolWheel);
+  EXPECT_TRUE(stream.events.empty());
+}
+
+TEST_F(CoreTest, MouseIdInvalid) {
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+  stream.queue({ 'A', 'T', '\r' });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(core.getMouseIdState(), kSerialMouseIdFailed);
+  EXPECT_NE(core.completeMouseId(), kSerialMouseSuccess);
+}
+
+TEST_F(CoreTest, MouseIdTimeout) {
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+  drainFakeStream(core, stream);
+
+  EXPECT_NE(core.completeMouseId(), kSerialMouseSuccess);
+  EXPECT_EQ(core.getMouseIdState(), kSerialMouseIdFailed);
+}
+
+TEST_F(CoreTest, MouseIdResumeProtocol) {
+  core.setProtocol(kSerialMouseProtocolWheel);
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+  drainFakeStream(core, stream);
+  ASSERT_NE(core.completeMouseId(), kSerialMouseSuccess);
+
+  //
+  // A mouse that did not answer again is decoded with the protocol it was identified with before.
+  //
+  core.resumeProtocol(kSerialMouseProtocolWheel);
+  stream.queue({ 0x40, 0x01, 0x02, 0x0F });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(core.getMouseIdState(), kSerialMouseIdComplete);
+  EXPECT_EQ(stream.events, (std::vector<FakeSerialStream::Event> { { 1, 2, -1, 0 } }));
+}
+
+//
+// A capture running across a new mouse ID only keeps the packets after it.
+//
+TEST_F(CoreTest, CaptureRestartsWithMouseId) {
+  uint8_t buffer[256];
+
+  core.getCapture().attach(buffer, sizeof (buffer));
+  core.getCapture().setActive(true);
+  stream.queue({ 0x40, 0x01, 0x02 });
+  drainFakeStream(core, stream);
+
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+  stream.queue({ MOUSE_ID_BYTE, MOUSE_ID_WHEEL_BYTE });
+  drainFakeStream(core, stream);
+  ASSERT_EQ(core.completeMouseId(), kSerialMouseSuccess);
+  EXPECT_EQ(core.getCapture().getLength(), 0U);
+
+  stream.queue({ 0x40, 0x01, 0x02, 0x0F });
+  drainFakeStream(core, stream);
+  EXPECT_EQ(core.getCapture().getLength(), (uint32_t) MOUSE_CAPTURE_RECORD_SIZE + 4);
+}
+
+TEST_F(CoreTest, SetDataRate) {
+  core.setProtocol(kSerialMouseProtocolLogitech);
+  ASSERT_EQ(core.setDataRate(9600), kSerialMouseSuccess);
+  EXPECT_EQ(core.getByteTimeNs(), 9 * 1000000000ULL / 9600);
+
+  core.setProtocol(kSerialMouseProtocolMouseSystems);
+  ASSERT_EQ(core.setDataRate(1200), kSerialMouseSuccess);
+  EXPECT_EQ(core.getByteTimeNs(), 10 * 1000000000ULL / 1200);
+  EXPECT_EQ(stream.dataRates.back(), 1200U);
+}
+
+//
+// Blocking ID check as used by the host tool, against a mouse that sends its ID once DTR is raised again.
+//
+class IdentifyingStream : public FakeSerialStream {
+public:
+  virtual SerialMouseStatus setModemLines(bool rts, bool dtr) override {
+    if (dtr && !dtrStates.empty() && !dtrStates.back()) {
+      queue({ MOUSE_ID_BYTE, MOUSE_ID_LOGI_BYTE });
+    }
+    return FakeSerialStream::setModemLines(rts, dtr);
+  }
+};
+
+TEST(CoreIdTest, CheckMouseIdThenDecode) {
+  IdentifyingStream mouse;
+  SerialMouseCore   core;
+
+  core.attach(&mouse, &mouse);
+  core.setCoalesceThreshold(0);
+  ASSERT_EQ(core.setupPort(), kSerialMouseSuccess);
+  ASSERT_EQ(core.checkMouseId(), kSerialMouseSuccess);
+  EXPECT_EQ(core.getProtocol(), kSerialMouseProtocolLogitech);
+
+  mouse.queue({ 0x40, 0x01, 0x00, 0x20 });
+  drainFakeStream(core, mouse);
+  EXPECT_EQ(mouse.events, (std::vector<FakeSerialStream::Event> { { 1, 0, 0, 0 }, { 0, 0, 0, HID_MOUSE_MIDDLEB } }));
+}
+
+//
+// Logitech data rate negotiation, against a mouse that supports rates up to maxDataRate.
+//
+class NegotiationTest : public CoreTest {
+protected:
+  uint32_t maxDataRate   = 9600;
+  uint32_t mouseDataRate = 1200;
+  bool     prefix        = false;
+
+  void SetUp() override {
+    CoreTest::SetUp();
+    core.setProtocol(kSerialMouseProtocolLogitech);
+
+    stream.onWrite = [this](FakeSerialStream &port, uint8_t byte) {
+      static const struct {
+        uint8_t  command;
+        uint32_t dataRate;
+      } rates[] = {
+        { MOUSE_LOGI_CMD_1200, 1200 }, { MOUSE_LOGI_CMD_2400, 2400 }, { MOUSE_LOGI_CMD_4800, 4800 }, { MOUSE_LOGI_CMD_9600, 9600 }
+      };
+
+      if (prefix) {
+        prefix = false;
+        for (const auto &rate : rates) {
+          if (rate.command == byte && rate.dataRate <= maxDataRate) {
+            mouseDataRate = rate.dataRate;
+          }
+        }
+        return;
+      }
+
+      //
+      // A polled packet only arrives intact when the port matches the mouse.
+      //
+      if (byte == MOUSE_LOGI_CMD_PREFIX) {
+        prefix = true;
+      } else if (byte == MOUSE_LOGI_CMD_POLL) {
+        if (port.dataRates.back() == mouseDataRate) {
+          port.queue({ 0x40, 0x00, 0x00 });
+        } else {
+          port.queue({ 0x1F });
+        }
+      }
+    };
+  }
+};
+
+TEST_F(NegotiationTest, HighestRate) {
+  ASSERT_EQ(core.negotiateDataRate(), kSerialMouseSuccess);
+
+  EXPECT_EQ(core.getDataRate(), 9600U);
+  EXPECT_EQ(core.getByteTimeNs(), 9 * 1000000000ULL / 9600);
+  EXPECT_EQ(stream.written.back(), MOUSE_LOGI_CMD_RATE_150);
+}
+
+TEST_F(NegotiationTest, FallBackToSupportedRate) {
+  maxDataRate = 2400;
+  ASSERT_EQ(core.negotiateDataRate(), kSerialMouseSuccess);
+
+  EXPECT_EQ(core.getDataRate(), 2400U);
+  EXPECT_EQ(stream.dataRates, (std::vector<uint32_t> { 1200, 9600, 1200, 4800, 1200, 2400 }));
+}
+
+TEST_F(NegotiationTest, NoSupportedRate) {
+  maxDataRate = 1200;
+  ASSERT_EQ(core.negotiateDataRate(), kSerialMouseSuccess);
+
+  EXPECT_EQ(core.getDataRate(), 1200U);
+  EXPECT_EQ(stream.written.back(), MOUSE_LOGI_CMD_RATE_150);
+}
+
+TEST_F(NegotiationTest, OnlyLogitech) {
+  core.setProtocol(kSerialMouseProtocolWheel);
+  ASSERT_EQ(core.negotiateDataRate(), kSerialMouseSuccess);
+
+  EXPECT_TRUE(stream.written.empty());
+  EXPECT_EQ(core.getDataRate(), 1200U);
+}
+
+TEST_F(NegotiationTest, ReportRate) {
+  core.setReportRate(120);
+  ASSERT_EQ(core.applyReportRate(), kSerialMouseSuccess);
+  core.setReportRate(5);
+  ASSERT_EQ(core.applyReportRate(), kSerialMouseSuccess);
+  core.setReportRate(MOUSE_REPORT_RATE_CONTINUOUS);
+  ASSERT_EQ(core.applyReportRate(), kSerialMouseSuccess);
+
+  EXPECT_EQ(stream.written, (std::vector<uint8_t> { MOUSE_LOGI_CMD_RATE_100, MOUSE_LOGI_CMD_RATE_10, MOUSE_LOGI_CMD_CONTINUOUS }));
+}
@@ -0,0 +1,180 @@
+//
+//  SerialMouseDecoderTests.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#include <gtest/gtest.h>
+
+#include "FakeSerialStream.hpp"
+
+typedef FakeSerialStream::Event Event;
+
+class DecoderTest : public ::testing::Test {
+protected:
+  FakeSerialStream stream;
+  SerialMouseCore  core;
+
+  void start(SerialMouseProtocol protocol) {
+    core.attach(&stream, &stream);
+    core.setProtocol(protocol);
+    core.setCoalesceThreshold(0);
+    ASSERT_EQ(core.setupPort(), kSerialMouseSuccess);
+  }
+};
+
+//
+// Protocols.
+//
+TEST_F(DecoderTest, Microsoft) {
+  start(kSerialMouseProtocolMicrosoft);
+  stream.queue({ 0x40 | 0x20 | 0x0E, 0x3F, 0x01, 0x40 | 0x10, 0x05, 0x3E });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { -65, -63, 0, HID_MOUSE_LEFTB }, { 5, 62, 0, HID_MOUSE_RIGHTB } }));
+  EXPECT_EQ(core.getStatistics().packetsDecoded, 2U);
+}
+
+TEST_F(DecoderTest, Wheel) {
+  start(kSerialMouseProtocolWheel);
+  stream.queue({ 0x40, 0x01, 0x02, 0x10 | 0x0F, 0x40, 0x00, 0x00, 0x01 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 1, 2, -1, HID_MOUSE_MIDDLEB }, { 0, 0, 1, 0 } }));
+}
+
+TEST_F(DecoderTest, LogitechExtensionByte) {
+  start(kSerialMouseProtocolLogitech);
+
+  //
+  // Press and release the middle button, the extension byte is only sent when it changes.
+  //
+  stream.queue({ 0x40, 0x01, 0x00, 0x20, 0x40, 0x02, 0x00, 0x40, 0x00, 0x00, 0x00 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> {
+    { 1, 0, 0, 0 }, { 0, 0, 0, HID_MOUSE_MIDDLEB }, { 2, 0, 0, HID_MOUSE_MIDDLEB }, { 0, 0, 0, 0 }
+  }));
+  EXPECT_EQ(core.getStatistics().droppedPartialPackets, 0U);
+}
+
+TEST_F(DecoderTest, LogitechExtensionByteInNextRead) {
+  start(kSerialMouseProtocolLogitech);
+  stream.queue({ 0x60, 0x01, 0x00 });
+  drainFakeStream(core, stream);
+  stream.queue({ 0x20 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 1, 0, 0, HID_MOUSE_LEFTB }, { 0, 0, 0, HID_MOUSE_LEFTB | HID_MOUSE_MIDDLEB } }));
+}
+
+TEST_F(DecoderTest, LogitechStrayByteAfterPacket) {
+  start(kSerialMouseProtocolLogitech);
+
+  //
+  // Data bytes after a packet that are not a valid extension byte are dropped, not decoded as the middle button.
+  //
+  stream.queue({ 0x40, 0x01, 0x00, 0x21, 0x20, 0x40, 0x02, 0x00 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 1, 0, 0, 0 }, { 2, 0, 0, 0 } }));
+  EXPECT_EQ(core.getStatistics().droppedPartialPackets, 1U);
+}
+
+TEST_F(DecoderTest, MouseSystems) {
+  start(kSerialMouseProtocolMouseSystems);
+  stream.queue({ 0x80 | 0x02, 0x7F, 0x01, 0x01, 0xFE, 0x87, 0x00, 0x00, 0x00, 0x00 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 128, 1, 0, HID_MOUSE_LEFTB | HID_MOUSE_RIGHTB }, { 0, 0, 0, 0 } }));
+}
+
+TEST_F(DecoderTest, HeaderTableMatchesComputedHeader) {
+  for (uint32_t byte = 0; byte < 256; byte++) {
+    EXPECT_EQ(MicrosoftProtocolTraits::lookupHeader((uint8_t) byte), MicrosoftProtocolTraits::computeHeader((uint8_t) byte));
+  }
+}
+
+//
+// Packets split across reads decode the same as whole ones.
+//
+TEST_F(DecoderTest, SplitReads) {
+  start(kSerialMouseProtocolWheel);
+  stream.readSize = 1;
+  stream.queue({ 0x40, 0x01, 0x02, 0x03, 0x60, 0x04, 0x05, 0x00 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 1, 2, 3, 0 }, { 4, 5, 0, HID_MOUSE_LEFTB } }));
+  EXPECT_EQ(stream.reads, 9U);
+}
+
+//
+// Resync.
+//
+TEST_F(DecoderTest, ResyncOnHeaderWithinPacket) {
+  start(kSerialMouseProtocolMicrosoft);
+  stream.queue({ 0x40, 0x01, 0x40, 0x02, 0x03 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 2, 3, 0, 0 } }));
+  EXPECT_EQ(core.getStatistics().headerResyncs, 1U);
+  EXPECT_EQ(core.getStatistics().packetsDecoded, 1U);
+}
+
+TEST_F(DecoderTest, DiscardBytesWithoutHeader) {
+  start(kSerialMouseProtocolMicrosoft);
+  stream.queue({ 0x01, 0x02, 0x03, 0x40, 0x04, 0x05, 0x06, 0x40, 0x07, 0x08 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 4, 5, 0, 0 }, { 7, 8, 0, 0 } }));
+  EXPECT_EQ(core.getStatistics().droppedPartialPackets, 2U);
+}
+
+TEST_F(DecoderTest, MouseSystemsResyncOnSyncByte) {
+  start(kSerialMouseProtocolMouseSystems);
+  stream.queue({ 0x01, 0x02, 0x83, 0x02, 0xFE, 0x03, 0x01 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 5, 1, 0, HID_MOUSE_LEFTB } }));
+  EXPECT_EQ(core.getStatistics().droppedPartialPackets, 1U);
+}
+
+//
+// Event filtering.
+//
+TEST_F(DecoderTest, SuppressNullPackets) {
+  start(kSerialMouseProtocolMicrosoft);
+  stream.queue({ 0x40, 0x00, 0x00, 0x60, 0x00, 0x00, 0x60, 0x00, 0x00, 0x60, 0x01, 0x00, 0x40, 0x00, 0x00 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 0, 0, 0, HID_MOUSE_LEFTB }, { 1, 0, 0, HID_MOUSE_LEFTB }, { 0, 0, 0, 0 } }));
+  EXPECT_EQ(core.getStatistics().nullPacketsSuppressed, 2U);
+}
+
+TEST_F(DecoderTest, CoalesceWhenBehind) {
+  start(kSerialMouseProtocolMicrosoft);
+  core.setCoalesceThreshold(2);
+  stream.queue({ 0x40, 0x01, 0x01, 0x40, 0x01, 0x01, 0x40, 0x01, 0x01, 0x60, 0x00, 0x00, 0x60, 0x02, 0x00 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events, (std::vector<Event> { { 3, 3, 0, 0 }, { 2, 0, 0, HID_MOUSE_LEFTB } }));
+  EXPECT_EQ(core.getStatistics().coalescedPackets, 3U);
+  EXPECT_EQ(core.getStatistics().eventsDispatched, 2U);
+
+  //
+  // Each event is stamped with the arrival of the first packet it combines, all bytes were read at once.
+  //
+  EXPECT_EQ(stream.events[0].timestampNs, stream.nowNs - 14 * core.getByteTimeNs());
+  EXPECT_EQ(stream.events[1].timestampNs, stream.nowNs - 5 * core.getByteTimeNs());
+}
+
+TEST_F(DecoderTest, NoCoalescingBelowThreshold) {
+  start(kSerialMouseProtocolMicrosoft);
+  core.setCoalesceThreshold(2);
+  stream.queue({ 0x40, 0x01, 0x01, 0x40, 0x01, 0x01 });
+  drainFakeStream(core, stream);
+
+  EXPECT_EQ(stream.events.size(), 2U);
+  EXPECT_EQ(core.getStatistics().coalescedPackets, 0U);
+}
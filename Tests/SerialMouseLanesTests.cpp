@@ -0,0 +1,199 @@
+//
+//  SerialMouseLanesTests.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#include <gtest/gtest.h>
+
+#include <memory>
+
+#include "FakeSerialStream.hpp"
+#include "SerialMouseLanes.hpp"
+
+#define LANES_MOUSE_COUNT   (MOUSE_SCHEDULER_LANE_COUNT * MOUSE_SCHEDULER_LANE_PORTS)
+#define LANES_PASS_COUNT    100
+
+//
+// Simulated mouse on a shared reader lane.
+//
+struct LaneMouse {
+  FakeSerialStream stream;
+  SerialMouseCore  core;
+  uint32_t         services = 0;
+
+  LaneMouse() {
+    core.attach(&stream, &stream);
+    core.setProtocol(kSerialMouseProtocolMicrosoft);
+    core.setCoalesceThreshold(0);
+    core.setupPort();
+  }
+
+  //
+  // Mirrors SerialMouse::serviceReceive(), ports without queued data are skipped without a read.
+  //
+  bool service(uint32_t maxReads) {
+    uint32_t count;
+
+    services++;
+    if (stream.queued() == 0) {
+      return false;
+    }
+    core.markWakeup();
+    for (uint32_t reads = 0; reads < maxReads; reads++) {
+      if (core.receiveData(0, &count) != kSerialMouseSuccess || count == 0) {
+        break;
+      }
+      core.processRingBuffer();
+    }
+    return true;
+  }
+};
+
+class LanesTest : public ::testing::Test {
+protected:
+  SerialMouseLanes<LaneMouse>             lanes;
+  std::vector<std::unique_ptr<LaneMouse>> mice;
+
+  //
+  // Adds mice the way the driver does, each one to the least busy lane.
+  //
+  void addMice(uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t lane = lanes.reserveLane();
+      ASSERT_LT(lane, lanes.getLaneCount());
+      mice.emplace_back(new LaneMouse());
+      ASSERT_TRUE(lanes.addPort(lane, mice.back().get()));
+    }
+  }
+
+  uint32_t servicePass() {
+    uint32_t intervalMs = 0;
+    for (uint32_t lane = 0; lane < lanes.getLaneCount(); lane++) {
+      intervalMs = lanes.service(lane, [](LaneMouse *mouse, uint32_t maxReads) { return mouse->service(maxReads); });
+    }
+    return intervalMs;
+  }
+};
+
+TEST_F(LanesTest, SpreadsPortsEvenly) {
+  addMice(LANES_MOUSE_COUNT);
+
+  for (uint32_t lane = 0; lane < lanes.getLaneCount(); lane++) {
+    EXPECT_EQ(lanes.getPortCount(lane), (uint32_t) MOUSE_SCHEDULER_LANE_PORTS);
+  }
+
+  EXPECT_EQ(lanes.reserveLane(), lanes.getLaneCount());
+}
+
+//
+// Ports reserve their lane before they are added, so ports still starting count against it.
+//
+TEST_F(LanesTest, ReservesBeforeAdd) {
+  EXPECT_EQ(lanes.reserveLane(), 0U);
+  EXPECT_EQ(lanes.reserveLane(), 1U);
+  EXPECT_EQ(lanes.reserveLane(), 0U);
+  EXPECT_EQ(lanes.getPortCount(0), 0U);
+
+  lanes.releaseLane(0);
+  lanes.releaseLane(0);
+  EXPECT_EQ(lanes.getReservedCount(0), 0U);
+  EXPECT_EQ(lanes.reserveLane(), 0U);
+}
+
+TEST_F(LanesTest, RemovePort) {
+  addMice(3);
+
+  //
+  // Mice alternate between the lanes, so the first and third share lane 0.
+  //
+  EXPECT_TRUE(lanes.removePort(0, mice[0].get()));
+  EXPECT_FALSE(lanes.removePort(0, mice[0].get()));
+  lanes.releaseLane(0);
+  servicePass();
+
+  EXPECT_EQ(mice[0]->services, 0U);
+  EXPECT_EQ(mice[1]->services, 1U);
+  EXPECT_EQ(mice[2]->services, 1U);
+  EXPECT_EQ(lanes.reserveLane(), 0U);
+}
+
+TEST_F(LanesTest, RotatesFirstPort) {
+  std::vector<LaneMouse *> order;
+
+  addMice(6);
+  for (uint32_t pass = 0; pass < 3; pass++) {
+    lanes.service(0, [&order](LaneMouse *mouse, uint32_t maxReads) { order.push_back(mouse); return true; });
+  }
+
+  EXPECT_EQ(order, (std::vector<LaneMouse *> {
+    mice[0].get(), mice[2].get(), mice[4].get(),
+    mice[2].get(), mice[4].get(), mice[0].get(),
+    mice[4].get(), mice[0].get(), mice[2].get()
+  }));
+}
+
+//
+// All mice report at full rate, one packet per pass, while the first one also has a large backlog.
+// Every mouse is serviced once per pass, so the backlog is worked off a batch at a time without delaying the others.
+//
+TEST_F(LanesTest, FairnessUnderLoad) {
+  addMice(LANES_MOUSE_COUNT);
+
+  //
+  // A read takes at most a ring buffer of data, so the backlog outlasts the run.
+  //
+  LaneMouse &noisy = *mice[0];
+  for (uint32_t i = 0; i < (LANES_PASS_COUNT + 1) * MOUSE_RING_SIZE / 3; i++) {
+    noisy.stream.queue({ 0x40, 0x01, 0x00 });
+  }
+  uint32_t backlog = (uint32_t) noisy.stream.queued();
+
+  for (uint32_t pass = 0; pass < LANES_PASS_COUNT; pass++) {
+    for (auto &mouse : mice) {
+      mouse->stream.queue({ 0x40, 0x01, 0x01 });
+    }
+    servicePass();
+
+    for (uint32_t i = 1; i < mice.size(); i++) {
+      ASSERT_EQ(mice[i]->stream.events.size(), pass + 1) << "mouse " << i << " pass " << pass;
+    }
+  }
+
+  for (auto &mouse : mice) {
+    EXPECT_EQ(mouse->services, (uint32_t) LANES_PASS_COUNT);
+    EXPECT_EQ(mouse->stream.reads, (uint32_t) LANES_PASS_COUNT);
+    EXPECT_EQ(mouse->core.getStatistics().droppedPartialPackets, 0U);
+  }
+
+  //
+  // The busy mouse made steady progress on its backlog with one read per pass.
+  //
+  EXPECT_GT(noisy.stream.events.size(), (size_t) LANES_PASS_COUNT);
+  EXPECT_LT(noisy.stream.position, (size_t) backlog);
+}
+
+//
+// A lane with no data backs off to the idle interval, and returns to the normal one as soon as a port has data.
+//
+TEST_F(LanesTest, IdleBackoff) {
+  addMice(2);
+
+  std::vector<uint32_t> intervals;
+  for (uint32_t pass = 0; pass < 5; pass++) {
+    intervals.push_back(lanes.service(1, [](LaneMouse *mouse, uint32_t maxReads) { return mouse->service(maxReads); }));
+  }
+  EXPECT_EQ(intervals, (std::vector<uint32_t> { 8, 16, 32, 32, 32 }));
+
+  mice[1]->stream.queue({ 0x40, 0x01, 0x00 });
+  EXPECT_EQ(lanes.service(1, [](LaneMouse *mouse, uint32_t maxReads) { return mouse->service(maxReads); }),
+            (uint32_t) MOUSE_SCHEDULER_INTERVAL_MS);
+  EXPECT_EQ(mice[1]->stream.events.size(), 1U);
+
+  //
+  // A lane without ports is not polled again.
+  //
+  EXPECT_TRUE(lanes.removePort(1, mice[1].get()));
+  EXPECT_EQ(lanes.service(1, [](LaneMouse *mouse, uint32_t maxReads) { return mouse->service(maxReads); }), 0U);
+}
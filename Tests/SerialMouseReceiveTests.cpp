@@ -0,0 +1,260 @@
+//
+//  SerialMouseReceiveTests.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "FakeSerialStream.hpp"
+
+//
+// Maximum time for a cancelled receive loop to exit. The driver waits MOUSE_THREAD_EXIT_TIMEOUT_MS at most.
+// Blocking in the fake port is bounded as well, so a broken cancellation fails the test instead of hanging it.
+//
+#define RECEIVE_STOP_BOUND_MS 50
+#define RECEIVE_BLOCK_TIMEOUT std::chrono::seconds(5)
+
+//
+// Receive loop against a port that wakes it once per packet where possible.
+//
+TEST(ReceiveLoopTest, PacketWakeups) {
+  FakeSerialStream stream;
+  SerialMouseCore  core;
+  FakeReceiver     receiver(core);
+
+  core.attach(&stream, &stream);
+  core.setProtocol(kSerialMouseProtocolMicrosoft);
+  core.setPacketWakeup(true);
+  ASSERT_EQ(core.setupPort(), kSerialMouseSuccess);
+
+  //
+  // A partial packet is left after the first wakeup, so the next wait is for a single byte.
+  //
+  stream.queue({ 0x40, 0x01, 0x00, 0x40 });
+  core.runReceiveLoop(&receiver);
+
+  EXPECT_EQ(stream.events.size(), 1U);
+  EXPECT_EQ(stream.packetWaits, (std::vector<bool> { true, false }));
+}
+
+TEST(ReceiveLoopTest, WakeupLatency) {
+  FakeSerialStream stream;
+  SerialMouseCore  core;
+  FakeReceiver     receiver(core);
+
+  core.attach(&stream, &stream);
+  core.setProtocol(kSerialMouseProtocolMicrosoft);
+  core.setPacketWakeup(true);
+  ASSERT_EQ(core.setupPort(), kSerialMouseSuccess);
+
+  //
+  // The wakeup waited for the first packet, the second one arrived while the reader was waking up,
+  // so it woke three byte times after the wait was satisfied.
+  //
+  stream.queue({ 0x40, 0x01, 0x00, 0x40, 0x02, 0x00 });
+  core.runReceiveLoop(&receiver);
+
+  SerialMouseHistogram expected = { };
+  expected.record(3 * core.getByteTimeNs());
+  EXPECT_EQ(memcmp(&core.getWakeupHistogram(), &expected, sizeof (expected)), 0);
+  EXPECT_EQ(stream.events.size(), 2U);
+}
+
+TEST(ReceiveLoopTest, PacketWakeupsWithLogitechExtension) {
+  FakeSerialStream stream;
+  SerialMouseCore  core;
+  FakeReceiver     receiver(core);
+
+  core.attach(&stream, &stream);
+  core.setProtocol(kSerialMouseProtocolLogitech);
+  core.setPacketWakeup(true);
+  ASSERT_EQ(core.setupPort(), kSerialMouseSuccess);
+
+  //
+  // The optional extension byte does not keep the loop on byte wakeups, it is decoded with whatever is read next.
+  //
+  stream.queue({ 0x40, 0x01, 0x00 });
+  core.runReceiveLoop(&receiver);
+  EXPECT_TRUE(core.isExtensionPending());
+
+  stream.queue({ 0x20 });
+  core.runReceiveLoop(&receiver);
+  EXPECT_FALSE(core.isExtensionPending());
+
+  EXPECT_EQ(stream.events.size(), 2U);
+  EXPECT_EQ(stream.packetWaits, (std::vector<bool> { true, true, true, true }));
+}
+
+//
+// Back to back Logitech packets. The extension byte timer fires after the next packet has started, and drains its
+// first two bytes. The last byte alone must still wake a thread that is already waiting for a full packet.
+//
+TEST(ReceiveLoopTest, ExtensionTimerLeavesPartialPacket) {
+  FakeSerialStream stream;
+  SerialMouseCore  core;
+  FakeReceiver     receiver(core);
+
+  core.attach(&stream, &stream);
+  core.setProtocol(kSerialMouseProtocolLogitech);
+  core.setPacketWakeup(true);
+  ASSERT_EQ(core.setupPort(), kSerialMouseSuccess);
+  stream.setWakeupThreshold(core.getPacketLength());
+
+  stream.queue({ 0x40, 0x01, 0x00 });
+  core.runReceiveLoop(&receiver);
+  EXPECT_TRUE(core.isExtensionPending());
+
+  stream.queue({ 0x40, 0x02 });
+  drainFakeStream(core, stream);
+  core.releasePartialPacket();
+  EXPECT_TRUE(core.isPacketPending());
+
+  stream.queue({ 0x00 });
+  EXPECT_EQ(stream.waitForData(true), kSerialMouseSuccess);
+  core.runReceiveLoop(&receiver);
+
+  EXPECT_EQ(stream.events, (std::vector<FakeSerialStream::Event> { { 1, 0, 0, 0 }, { 2, 0, 0, 0 } }));
+  EXPECT_EQ(stream.wakeupThresholds, (std::vector<uint32_t> { 3, 1, 3 }));
+  EXPECT_EQ(stream.wakeupThreshold, 3U);
+}
+
+TEST(ReceiveLoopTest, ByteWakeupsWhileIdentifying) {
+  FakeSerialStream stream;
+  SerialMouseCore  core;
+  FakeReceiver     receiver(core);
+
+  core.attach(&stream, &stream);
+  core.setPacketWakeup(true);
+  ASSERT_EQ(core.setupPort(), kSerialMouseSuccess);
+  ASSERT_EQ(core.beginMouseId(), kSerialMouseSuccess);
+
+  stream.readSize = 1;
+  stream.queue({ MOUSE_ID_BYTE, MOUSE_ID_WHEEL_BYTE });
+  core.runReceiveLoop(&receiver);
+
+  EXPECT_EQ(core.getProtocol(), kSerialMouseProtocolWheel);
+  EXPECT_EQ(stream.packetWaits, (std::vector<bool> { false, true }));
+}
+
+//
+// Port that blocks waiting for data, or inside a read, until it is deactivated, like a serial driver
+// blocked in watchState() or dequeueData().
+//
+class BlockingStream : public FakeSerialStream {
+public:
+  std::mutex              lock;
+  std::condition_variable changed;
+  bool                    blockInRead = false;
+  bool                    blocked     = false;
+
+  virtual SerialMouseStatus setActive(bool state) override {
+    std::lock_guard<std::mutex> guard(lock);
+    active = state;
+    changed.notify_all();
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus waitForData(bool packet) override {
+    std::unique_lock<std::mutex> guard(lock);
+    blocked = true;
+    changed.notify_all();
+    changed.wait_for(guard, RECEIVE_BLOCK_TIMEOUT, [this] { return !active || queued() > 0; });
+    blocked = false;
+    return active ? kSerialMouseSuccess : kSerialMouseInvalid;
+  }
+
+  virtual SerialMouseStatus readData(uint8_t *buffer, uint32_t size, uint32_t *count, uint32_t min) override {
+    std::unique_lock<std::mutex> guard(lock);
+    if (blockInRead) {
+      blocked = true;
+      changed.notify_all();
+      changed.wait_for(guard, RECEIVE_BLOCK_TIMEOUT, [this] { return !active; });
+      blocked = false;
+      *count = 0;
+      return kSerialMouseInvalid;
+    }
+    return FakeSerialStream::readData(buffer, size, count, min);
+  }
+
+  void waitUntilBlocked() {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait_for(guard, RECEIVE_BLOCK_TIMEOUT, [this] { return blocked; });
+  }
+};
+
+class ReceiveStopTest : public ::testing::Test {
+protected:
+  BlockingStream   stream;
+  SerialMouseCore  core;
+  FakeReceiver     receiver { core };
+  std::thread      thread;
+
+  void SetUp() override {
+    core.attach(&stream, &stream);
+    core.setCoalesceThreshold(0);
+    ASSERT_EQ(core.setupPort(), kSerialMouseSuccess);
+    thread = std::thread([this] { core.runReceiveLoop(&receiver); });
+  }
+
+  void TearDown() override {
+    if (thread.joinable()) {
+      core.cancelReceive();
+      thread.join();
+    }
+  }
+
+  //
+  // Cancels the loop the way the driver does on stop, and returns the time until the thread has exited.
+  //
+  std::chrono::milliseconds stop() {
+    auto start = std::chrono::steady_clock::now();
+    core.cancelReceive();
+    thread.join();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  }
+};
+
+TEST_F(ReceiveStopTest, StopWhileWaiting) {
+  stream.waitUntilBlocked();
+
+  EXPECT_LT(stop().count(), RECEIVE_STOP_BOUND_MS);
+  EXPECT_TRUE(core.isReceiveCancelled());
+  EXPECT_FALSE(stream.active);
+}
+
+TEST_F(ReceiveStopTest, StopAfterData) {
+  stream.waitUntilBlocked();
+  {
+    std::lock_guard<std::mutex> guard(stream.lock);
+    stream.queue({ 0x40, 0x01, 0x00 });
+    stream.blocked = false;
+    stream.changed.notify_all();
+  }
+  stream.waitUntilBlocked();
+
+  EXPECT_LT(stop().count(), RECEIVE_STOP_BOUND_MS);
+  EXPECT_EQ(stream.events.size(), 1U);
+  EXPECT_EQ(receiver.wakeups, 1U);
+}
+
+TEST_F(ReceiveStopTest, StopWhileBlockedInRead) {
+  stream.waitUntilBlocked();
+  {
+    std::lock_guard<std::mutex> guard(stream.lock);
+    stream.blockInRead = true;
+    stream.queue({ 0x40 });
+    stream.blocked = false;
+    stream.changed.notify_all();
+  }
+  stream.waitUntilBlocked();
+
+  EXPECT_LT(stop().count(), RECEIVE_STOP_BOUND_MS);
+  EXPECT_EQ(core.getStatistics().dequeueErrors, 1U);
+}
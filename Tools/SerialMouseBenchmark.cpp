@@ -0,0 +1,382 @@
+//
+//  SerialMouseBenchmark.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+//  Measures decode throughput of the receive path on the host, to catch regressions before they ship.
+//  Runs through the core also report serial driver reads and pointer dispatches per decoded packet.
+//
+//  Built by the host CMake build against Google Benchmark, which is optimized by default:
+//    cmake -S . -B build && cmake --build build
+//
+//  Usage: SerialMouseBenchmark [--benchmark_filter=<regex>] [--benchmark_min_time=<seconds>] [...]
+//    Each run decodes the whole generated stream once. packet_time is the time per decoded packet,
+//    reads and dispatches are serial driver reads and pointer dispatches per packet.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <benchmark/benchmark.h>
+
+#include "SerialMouseCore.hpp"
+
+//
+// Packets in each generated stream.
+//
+#define BENCH_PACKET_COUNT  100000
+
+//
+// Generated serial stream.
+//
+struct BenchStream {
+  uint8_t  *data     = nullptr;
+  uint32_t length    = 0;
+  uint32_t packets   = 0;
+
+  void append(uint8_t byte) {
+    data[length++] = byte;
+  }
+};
+
+static uint32_t gSeed = 1;
+
+static uint32_t nextRandom() {
+  gSeed = gSeed * 1103515245 + 12345;
+  return (gSeed >> 16) & 0x7FFF;
+}
+
+//
+// Builds a stream of packets with random non-zero motion and button changes.
+// Noisy streams have stray data bytes and packets cut short in between.
+//
+static void generateStream(BenchStream *stream, SerialMouseProtocol protocol, bool noisy) {
+  uint32_t maxLength = BENCH_PACKET_COUNT * 8;
+
+  free(stream->data);
+  stream->data    = static_cast<uint8_t *>(malloc(maxLength));
+  stream->length  = 0;
+  stream->packets = 0;
+  gSeed = 1;
+
+  while (stream->length + 16 < maxLength && stream->packets < BENCH_PACKET_COUNT) {
+    int8_t  dx      = (int8_t) ((nextRandom() % 64) + 1);
+    int8_t  dy      = (int8_t) -((int8_t) (nextRandom() % 64) + 1);
+    bool    left    = (nextRandom() % 16) == 0;
+    bool    right   = (nextRandom() % 16) == 0;
+    bool    middle  = (nextRandom() % 16) == 0;
+
+    if (noisy && nextRandom() % 8 == 0) {
+      if (protocol == kSerialMouseProtocolMouseSystems) {
+        stream->append(0x01);
+      } else {
+        //
+        // Stray data byte, or a header with only part of its packet.
+        //
+        stream->append((nextRandom() & 1) ? 0x15 : 0x40);
+      }
+    }
+
+    if (protocol == kSerialMouseProtocolMouseSystems) {
+      stream->append(0x80 | (left ? 0 : 0x4) | (middle ? 0 : 0x2) | (right ? 0 : 0x1));
+      stream->append((uint8_t) dx);
+      stream->append((uint8_t) dy);
+      stream->append(0);
+      stream->append(0);
+    } else {
+      stream->append(0x40 | (left ? 0x20 : 0) | (right ? 0x10 : 0) | (((uint8_t) dy >> 4) & 0xC) | (((uint8_t) dx >> 6) & 0x3));
+      stream->append((uint8_t) dx & 0x3F);
+      stream->append((uint8_t) dy & 0x3F);
+      if (protocol == kSerialMouseProtocolWheel) {
+        stream->append((middle ? 0x10 : 0) | (nextRandom() & 0x1));
+      } else if (protocol == kSerialMouseProtocolLogitech && middle) {
+        stream->append(0x20);
+      }
+    }
+    stream->packets++;
+  }
+}
+
+//
+// Serial stream that returns the generated data in reads of a fixed size, and a sink that only counts events.
+// Reads stand in for serial driver calls, and events for HID dispatches.
+//
+class BenchAdapter : public SerialMouseStream, public SerialMouseSink {
+public:
+  const BenchStream *stream    = nullptr;
+  uint32_t          position   = 0;
+  uint32_t          readSize   = 0;
+  uint64_t          timeNs     = 0;
+  uint64_t          reads      = 0;
+  uint64_t          events     = 0;
+  int64_t           checksum   = 0;
+
+  virtual SerialMouseStatus setLineSettings(uint32_t dataRate, uint32_t dataSize, uint32_t stopBits) override {
+    return kSerialMouseSuccess;
+  }
+  virtual SerialMouseStatus setModemLines(bool rts, bool dtr) override { return kSerialMouseSuccess; }
+  virtual SerialMouseStatus setActive(bool active) override { return kSerialMouseSuccess; }
+  virtual SerialMouseStatus flushReceive() override { return kSerialMouseSuccess; }
+
+  virtual SerialMouseStatus readData(uint8_t *buffer, uint32_t size, uint32_t *count, uint32_t min) override {
+    uint32_t remaining = stream->length - position;
+    reads++;
+    *count = (size < readSize) ? size : readSize;
+    *count = (*count < remaining) ? *count : remaining;
+    memcpy(buffer, &stream->data[position], *count);
+    position += *count;
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus writeData(const uint8_t *buffer, uint32_t size) override { return kSerialMouseSuccess; }
+  virtual SerialMouseStatus waitForData(bool packet) override { return kSerialMouseSuccess; }
+  virtual SerialMouseStatus setWakeupThreshold(uint32_t bytes) override { return kSerialMouseSuccess; }
+  virtual void sleep(uint32_t milliseconds) override { }
+  virtual uint64_t getUptimeNs() override { return timeNs++; }
+
+  virtual void dispatchPointer(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs) override {
+    events++;
+    checksum += dx - dy + dz + buttons;
+  }
+};
+
+//
+// Reports the decoded packets of a run, as a rate and as the time per packet.
+//
+static void setPacketCounters(benchmark::State &state, uint64_t packets) {
+  state.SetItemsProcessed((int64_t) packets);
+  state.counters["packet_time"] = benchmark::Counter((double) packets,
+                                                     benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+//
+// Runs the stream through the core the way the receive thread does: one wakeup per read, draining until empty.
+// The coalescing threshold is disabled so every packet is dispatched.
+//
+static void runCore(benchmark::State &state, const BenchStream *stream, SerialMouseProtocol protocol,
+                    uint32_t readSize) {
+  BenchAdapter    adapter;
+  SerialMouseCore core;
+  uint64_t        packets = 0;
+
+  adapter.stream   = stream;
+  adapter.readSize = readSize;
+  core.attach(&adapter, &adapter);
+  core.setCoalesceThreshold(0);
+
+  for (auto _ : state) {
+    core.setProtocol(protocol);
+    adapter.position = 0;
+
+    uint32_t count;
+    while (adapter.position < stream->length) {
+      core.markWakeup();
+      core.receiveData(0, &count);
+      core.processRingBuffer();
+    }
+    packets += stream->packets;
+  }
+  benchmark::DoNotOptimize(adapter.checksum);
+
+  setPacketCounters(state, packets);
+  state.counters["reads"]      = (double) adapter.reads / packets;
+  state.counters["dispatches"] = (double) adapter.events / packets;
+}
+
+//
+// Runs the decoder alone over the whole stream, to compare header decoding strategies without the core around it.
+//
+struct DecoderOutput {
+  uint64_t events   = 0;
+  int64_t  checksum = 0;
+
+  void dispatchPacket(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint32_t index) {
+    events++;
+    checksum += dx - dy + dz + buttons;
+  }
+};
+
+template <typename Traits>
+static void runDecoder(benchmark::State &state, const BenchStream *stream) {
+  SerialMouseRing        ring;
+  SerialMouseDecodeState decodeState = { };
+  SerialMouseStatistics  stats       = { };
+  DecoderOutput          output;
+  uint64_t               packets     = 0;
+
+  for (auto _ : state) {
+    ring.head = 0;
+    ring.tail = 0;
+    for (uint32_t position = 0; position < stream->length; ) {
+      while (ring.used() < MOUSE_RING_SIZE && position < stream->length) {
+        ring.buffer[ring.head++ & MOUSE_RING_MASK] = stream->data[position++];
+      }
+      PacketDecoder<Traits>::decode(ring, decodeState, stats, output);
+    }
+    packets += stream->packets;
+  }
+  benchmark::DoNotOptimize(output.checksum);
+
+  setPacketCounters(state, packets);
+}
+
+//
+// Packet macros and decode loop used before the protocol traits, kept as a baseline for the traits decoders.
+// The protocol is checked at runtime and each packet is copied out of the ring before decoding.
+//
+#define MOUSE_PACKET_LENGTH         3
+#define MOUSE_WHEEL_PACKET_LENGTH   4
+#define MOUSE_PACKET_MAX_LENGTH     5
+#define MOUSE_PACKET_HEADER_BIT     0x40
+#define MOUSE_PACKET_LEFTB_BIT      0x20
+#define MOUSE_PACKET_RIGHTB_BIT     0x10
+#define MOUSE_PACKET_MIDDLEB_BIT    0x10
+#define MOUSE_LOGI_MIDDLEB_BIT      0x20
+
+#define MOUSE_PACKET_VALID(packet)      ((bool)(packet[0] & MOUSE_PACKET_HEADER_BIT))
+#define MOUSE_PACKET_LEFTB(packet)      ((bool)(packet[0] & MOUSE_PACKET_LEFTB_BIT))
+#define MOUSE_PACKET_RIGHTB(packet)     ((bool)(packet[0] & MOUSE_PACKET_RIGHTB_BIT))
+#define MOUSE_PACKET_BUTTONS(packet)    ((uint32_t)((MOUSE_PACKET_LEFTB(packet) ? HID_MOUSE_LEFTB : 0) | \
+  (MOUSE_PACKET_RIGHTB(packet) ? HID_MOUSE_RIGHTB : 0)))
+#define MOUSE_PACKET_POSX(packet)       ((int8_t)((packet[1] & 0x3F) | ((packet[0] & 0x3) << 6)))
+#define MOUSE_PACKET_POSY(packet)       ((int8_t)((packet[2] & 0x3F) | ((packet[0] & 0xC) << 4)))
+#define MOUSE_PACKET_MIDDLEB(packet)    ((bool)(packet[3] & MOUSE_PACKET_MIDDLEB_BIT))
+#define MOUSE_PACKET_POSZ(packet)       ((int8_t)(packet[3] << 4) >> 4)
+#define MOUSE_LOGI_MIDDLEB(byte)        ((bool)((byte) & MOUSE_LOGI_MIDDLEB_BIT))
+
+struct MacroDecoder {
+  SerialMouseProtocol protocol;
+  uint32_t            packetLength;
+  bool                extensionPending = false;
+  uint32_t            packetButtons    = 0;
+  uint32_t            middleButton     = 0;
+
+  explicit MacroDecoder(SerialMouseProtocol protocol) : protocol(protocol),
+    packetLength((protocol == kSerialMouseProtocolWheel) ? MOUSE_WHEEL_PACKET_LENGTH : MOUSE_PACKET_LENGTH) { }
+
+  void decode(SerialMouseRing &ring, DecoderOutput &output) {
+    uint8_t packet[MOUSE_PACKET_MAX_LENGTH];
+
+    while ((ring.head - ring.tail) > 0) {
+      packet[0] = ring.buffer[ring.tail & MOUSE_RING_MASK];
+      if (!MOUSE_PACKET_VALID(packet)) {
+        if (extensionPending) {
+          extensionPending = false;
+          ring.tail++;
+
+          uint32_t middle = MOUSE_LOGI_MIDDLEB(packet[0]) ? HID_MOUSE_MIDDLEB : 0;
+          if (middle != middleButton) {
+            middleButton = middle;
+            output.dispatchPacket(0, 0, 0, packetButtons | middleButton, ring.tail - 1);
+          }
+          continue;
+        }
+        ring.tail++;
+        continue;
+      }
+      extensionPending = false;
+
+      if ((ring.head - ring.tail) < packetLength) {
+        break;
+      }
+
+      uint32_t packetSequence;
+      for (packetSequence = 1; packetSequence < packetLength; packetSequence++) {
+        packet[packetSequence] = ring.buffer[(ring.tail + packetSequence) & MOUSE_RING_MASK];
+        if (packet[packetSequence] & MOUSE_PACKET_HEADER_BIT) {
+          break;
+        }
+      }
+      uint32_t index = ring.tail;
+      ring.tail += packetSequence;
+      if (packetSequence < packetLength) {
+        continue;
+      }
+
+      packetButtons = MOUSE_PACKET_BUTTONS(packet);
+      if (protocol == kSerialMouseProtocolWheel) {
+        output.dispatchPacket(MOUSE_PACKET_POSX(packet), MOUSE_PACKET_POSY(packet), MOUSE_PACKET_POSZ(packet),
+                              packetButtons | (MOUSE_PACKET_MIDDLEB(packet) ? HID_MOUSE_MIDDLEB : 0), index);
+      } else {
+        extensionPending = (protocol == kSerialMouseProtocolLogitech);
+        output.dispatchPacket(MOUSE_PACKET_POSX(packet), MOUSE_PACKET_POSY(packet), 0, packetButtons | middleButton, index);
+      }
+    }
+  }
+};
+
+static void runMacroDecoder(benchmark::State &state, const BenchStream *stream, SerialMouseProtocol protocol) {
+  SerialMouseRing ring;
+  MacroDecoder    decoder(protocol);
+  DecoderOutput   output;
+  uint64_t        packets = 0;
+
+  for (auto _ : state) {
+    ring.head = 0;
+    ring.tail = 0;
+    for (uint32_t position = 0; position < stream->length; ) {
+      while (ring.used() < MOUSE_RING_SIZE && position < stream->length) {
+        ring.buffer[ring.head++ & MOUSE_RING_MASK] = stream->data[position++];
+      }
+      decoder.decode(ring, output);
+    }
+    packets += stream->packets;
+  }
+  benchmark::DoNotOptimize(output.checksum);
+
+  setPacketCounters(state, packets);
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    const char          *name;
+    SerialMouseProtocol protocol;
+  } protocols[] = {
+    { "Microsoft",    kSerialMouseProtocolMicrosoft },
+    { "Wheel",        kSerialMouseProtocolWheel },
+    { "Logitech",     kSerialMouseProtocolLogitech },
+    { "MouseSystems", kSerialMouseProtocolMouseSystems }
+  };
+  static BenchStream streams[sizeof (protocols) / sizeof (protocols[0])][2];
+  char               name[64];
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+
+  //
+  // Per-protocol decoding through the core, one byte per read as with per-byte wakeups, and in bulk reads.
+  //
+  for (size_t i = 0; i < sizeof (protocols) / sizeof (protocols[0]); i++) {
+    for (int noisy = 0; noisy < 2; noisy++) {
+      const BenchStream *stream = &streams[i][noisy];
+      generateStream(&streams[i][noisy], protocols[i].protocol, noisy != 0);
+
+      snprintf(name, sizeof (name), "%s/%s/byte", protocols[i].name, noisy ? "noisy" : "clean");
+      benchmark::RegisterBenchmark(name, runCore, stream, protocols[i].protocol, 1U);
+      snprintf(name, sizeof (name), "%s/%s/bulk", protocols[i].name, noisy ? "noisy" : "clean");
+      benchmark::RegisterBenchmark(name, runCore, stream, protocols[i].protocol, (uint32_t) MOUSE_RING_SIZE);
+    }
+  }
+
+  //
+  // Computed header fields against the header lookup table, and both against the old packet macros.
+  //
+  const BenchStream *microsoft = &streams[0][0];
+  benchmark::RegisterBenchmark("Decoder/Microsoft/computed", runDecoder<MicrosoftProtocolTraits>, microsoft);
+  benchmark::RegisterBenchmark("Decoder/Microsoft/table", runDecoder<TableHeaderTraits<MicrosoftProtocolTraits>>,
+                               microsoft);
+  benchmark::RegisterBenchmark("Decoder/Microsoft/macros", runMacroDecoder, microsoft, kSerialMouseProtocolMicrosoft);
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  for (size_t i = 0; i < sizeof (protocols) / sizeof (protocols[0]); i++) {
+    free(streams[i][0].data);
+    free(streams[i][1].data);
+  }
+  return 0;
+}
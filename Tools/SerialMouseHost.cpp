@@ -0,0 +1,318 @@
+//
+//  SerialMouseHost.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+//  Runs the driver core against a serial port or SerialMouseSimulator on the host, and reports
+//  throughput and latency in the same form as the driver statistics.
+//
+//  Build from the repository root:
+//    c++ -std=c++14 -pthread -ISerialMouse -o SerialMouseHost Tools/SerialMouseHost.cpp
+//        SerialMouse/SerialMouseCore.cpp SerialMouse/SerialMouseCapture.cpp SerialMouse/SerialMouseTrace.cpp
+//
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "SerialMouseCore.hpp"
+
+static uint64_t getTimeNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//
+// POSIX serial port. Ports without modem lines, such as pseudo-terminals, signal a DTR drop with a NUL byte.
+// The receive loop runs until the port is deactivated or the run time is over.
+//
+class HostAdapter : public SerialMouseStream, public SerialMouseSink, public SerialMouseReceiver {
+public:
+  SerialMouseCore *core    = nullptr;
+  int             fd       = -1;
+  bool            dtr      = true;
+  bool            active   = false;
+  bool            verbose  = false;
+  uint64_t        endNs    = 0;
+  uint64_t        events   = 0;
+
+  virtual SerialMouseStatus setLineSettings(uint32_t dataRate, uint32_t dataSize, uint32_t stopBits) override {
+    struct termios settings;
+    speed_t speed;
+
+    switch (dataRate) {
+      case 1200: speed = B1200; break;
+      case 2400: speed = B2400; break;
+      case 4800: speed = B4800; break;
+      case 9600: speed = B9600; break;
+      default:   return kSerialMouseInvalid;
+    }
+
+    if (tcgetattr(fd, &settings) != 0) {
+      return kSerialMouseInvalid;
+    }
+    cfmakeraw(&settings);
+    cfsetispeed(&settings, speed);
+    cfsetospeed(&settings, speed);
+    settings.c_cflag &= ~(CSIZE | CSTOPB | PARENB | CRTSCTS);
+    settings.c_cflag |= ((dataSize == 7) ? CS7 : CS8) | ((stopBits == 2) ? CSTOPB : 0) | CLOCAL | CREAD;
+    return (tcsetattr(fd, TCSANOW, &settings) == 0) ? kSerialMouseSuccess : kSerialMouseInvalid;
+  }
+
+  virtual SerialMouseStatus setModemLines(bool rts, bool dtrState) override {
+    int lines = 0;
+
+    if (ioctl(fd, TIOCMGET, &lines) == 0) {
+      lines = (lines & ~(TIOCM_RTS | TIOCM_DTR)) | (rts ? TIOCM_RTS : 0) | (dtrState ? TIOCM_DTR : 0);
+      dtr   = dtrState;
+      return (ioctl(fd, TIOCMSET, &lines) == 0) ? kSerialMouseSuccess : kSerialMouseInvalid;
+    }
+
+    if (dtr && !dtrState) {
+      const uint8_t reset = 0;
+      write(fd, &reset, sizeof (reset));
+    }
+    dtr = dtrState;
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus setActive(bool state) override {
+    active = state;
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus flushReceive() override {
+    return (tcflush(fd, TCIFLUSH) == 0) ? kSerialMouseSuccess : kSerialMouseInvalid;
+  }
+
+  virtual SerialMouseStatus readData(uint8_t *buffer, uint32_t size, uint32_t *count, uint32_t min) override {
+    *count = 0;
+    while (*count < size) {
+      struct pollfd pollFd = { fd, POLLIN, 0 };
+      if (poll(&pollFd, 1, (*count < min) ? -1 : 0) <= 0) {
+        break;
+      }
+
+      ssize_t length = read(fd, buffer + *count, size - *count);
+      if (length < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? kSerialMouseSuccess : kSerialMouseInvalid;
+      }
+      if (length == 0) {
+        break;
+      }
+      *count += (uint32_t) length;
+    }
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus writeData(const uint8_t *buffer, uint32_t size) override {
+    if (write(fd, buffer, size) != (ssize_t) size) {
+      return kSerialMouseInvalid;
+    }
+    tcdrain(fd);
+    return kSerialMouseSuccess;
+  }
+
+  //
+  // There are no receive queue watermarks, so this always waits for the next byte.
+  //
+  virtual SerialMouseStatus waitForData(bool packet) override {
+    while (active && getTimeNs() < endNs) {
+      struct pollfd pollFd = { fd, POLLIN, 0 };
+      if (poll(&pollFd, 1, 100) > 0) {
+        return kSerialMouseSuccess;
+      }
+    }
+    return kSerialMouseInvalid;
+  }
+
+  virtual SerialMouseStatus setWakeupThreshold(uint32_t bytes) override {
+    return kSerialMouseInvalid;
+  }
+
+  virtual void sleep(uint32_t milliseconds) override { usleep(milliseconds * 1000); }
+  virtual uint64_t getUptimeNs() override { return getTimeNs(); }
+
+  virtual void dispatchPointer(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs) override {
+    events++;
+    if (verbose) {
+      printf("%d %d %d 0x%X\n", dx, dy, dz, buttons);
+    }
+  }
+
+  //
+  // Drain the port in batches after each wakeup, like the driver does on its work loop.
+  //
+  virtual void receive(uint64_t wakeTimeNs, uint32_t wakeBytes) override {
+    uint32_t count;
+
+    core->markWakeup(wakeTimeNs, wakeBytes);    do {
+      if (core->receiveData(0, &count) != kSerialMouseSuccess) {
+        break;
+      }
+      core->processRingBuffer();
+    } while (count > 0);
+  }
+};
+
+//
+// CPU load. Each thread spins until the run is over, so the reader competes with them for every core.
+//
+static volatile bool gLoadRunning = true;
+
+static void *runLoadThread(void *) {
+  volatile uint64_t counter = 0;
+  while (gLoadRunning) {
+    counter++;
+  }
+  return nullptr;
+}
+
+static void printHistogram(const char *name, const SerialMouseHistogram &histogram) {
+  printf("%s:\n", name);
+  for (uint32_t i = 0; i < MOUSE_HISTOGRAM_BUCKETS; i++) {
+    if (histogram.buckets[i] != 0) {
+      printf("  < %8llu us: %u\n", 1ULL << i, histogram.buckets[i]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *path       = nullptr;
+  double     duration    = 10;
+  int        reportRate  = -1;
+  bool       mouseSystems = false;
+  bool       verbose     = false;
+  int        loadThreads = 0;
+  bool       realTime    = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      duration = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      reportRate = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-m") == 0) {
+      mouseSystems = true;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      loadThreads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-f") == 0) {
+      realTime = true;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == nullptr) {
+    fprintf(stderr, "usage: %s [-d seconds] [-r rate] [-m] [-v] [-l threads] [-f] port\n", argv[0]);
+    fprintf(stderr, "  -d  run time in seconds (default 10)\n");
+    fprintf(stderr, "  -r  Logitech report rate, 0 for continuous\n");
+    fprintf(stderr, "  -m  Mouse Systems mouse, otherwise detected from the mouse ID\n");
+    fprintf(stderr, "  -v  print every event\n");
+    fprintf(stderr, "  -l  run this many busy threads while receiving\n");
+    fprintf(stderr, "  -f  receive with the SCHED_FIFO real-time policy\n");
+    return 1;
+  }
+
+  HostAdapter adapter;
+  adapter.fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (adapter.fd < 0) {
+    perror(path);
+    return 1;
+  }
+  adapter.verbose = verbose;
+
+  SerialMouseCore core;
+  adapter.core = &core;
+  core.attach(&adapter, &adapter);
+  core.setProtocol(mouseSystems ? kSerialMouseProtocolMouseSystems : kSerialMouseProtocolMicrosoft);
+  if (reportRate >= 0) {
+    core.setReportRate((uint32_t) reportRate);
+  }
+
+  //
+  // Same sequence as the driver: port setup, mouse ID, then data rate negotiation for Logitech mice.
+  //
+  if (core.setupPort() != kSerialMouseSuccess) {
+    fprintf(stderr, "Failed to set up port\n");
+    return 1;
+  }
+  if (!mouseSystems) {
+    if (core.checkMouseId() != kSerialMouseSuccess) {
+      fprintf(stderr, "No serial mouse detected\n");
+      return 1;
+    }
+    if (core.negotiateDataRate() != kSerialMouseSuccess) {
+      fprintf(stderr, "Failed to negotiate data rate\n");
+    }
+  }
+  printf("Protocol %u at %u baud\n", core.getProtocol(), core.getDataRate());
+  core.resetHistograms();
+
+  //
+  // Load threads are started first so they do not inherit a real-time policy.
+  //
+  pthread_t *threads = static_cast<pthread_t *>(calloc(loadThreads > 0 ? loadThreads : 1, sizeof (pthread_t)));
+  for (int i = 0; i < loadThreads; i++) {
+    pthread_create(&threads[i], nullptr, runLoadThread, nullptr);
+  }
+  if (loadThreads > 0) {
+    printf("Running %d load threads\n", loadThreads);
+  }
+
+  //
+  // Compare wakeup latency under load with and without a real-time policy, like the driver's ReaderThreadPolicy.
+  //
+  if (realTime) {
+    struct sched_param param = { };
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (result != 0) {
+      fprintf(stderr, "Failed to set real-time policy: %s\n", strerror(result));
+    }
+  }
+
+  //
+  // Run the same receive loop as the receive thread.
+  //
+  uint64_t startNs = getTimeNs();
+  adapter.endNs = startNs + (uint64_t) (duration * 1000000000.0);
+  core.runReceiveLoop(&adapter);
+
+  gLoadRunning = false;
+  for (int i = 0; i < loadThreads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  free(threads);
+
+  double elapsed = (getTimeNs() - startNs) / 1000000000.0;
+  const SerialMouseStatistics &stats = core.getStatistics();
+  printf("Bytes read:              %u (%.0f/s)\n", stats.bytesRead, stats.bytesRead / elapsed);
+  printf("Packets decoded:         %u (%.0f/s)\n", stats.packetsDecoded, stats.packetsDecoded / elapsed);
+  printf("Events dispatched:       %llu\n", (unsigned long long) adapter.events);
+  printf("Header resyncs:          %u\n", stats.headerResyncs);
+  printf("Dropped partial packets: %u\n", stats.droppedPartialPackets);
+  printf("Packet rate:             %u\n", stats.packetRate);
+  printf("Max dispatch latency:    %u us\n", stats.maxDispatchLatencyUs);
+  printHistogram("Dispatch latency", core.getLatencyHistogram());
+  printHistogram("Packet interval", core.getIntervalHistogram());
+  printHistogram("Wakeup latency", core.getWakeupHistogram());
+
+  close(adapter.fd);
+  return 0;
+}
@@ -0,0 +1,208 @@
+//
+//  SerialMouseReplay.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+//  Replays a raw capture through the decoder on the host.
+//
+//  Build from the repository root:
+//    c++ -std=c++14 -ISerialMouse -o SerialMouseReplay Tools/SerialMouseReplay.cpp
+//        SerialMouse/SerialMouseCore.cpp SerialMouse/SerialMouseCapture.cpp SerialMouse/SerialMouseTrace.cpp
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "SerialMouseCore.hpp"
+
+//
+// Serial stream that returns one capture record per read, and pointer sink that prints events.
+// Time is taken from the capture so timestamps and rates match the original stream at any speed.
+//
+class ReplayAdapter : public SerialMouseStream, public SerialMouseSink {
+public:
+  const uint8_t *data     = nullptr;
+  uint32_t      length    = 0;
+  uint64_t      timeNs    = 0;
+  bool          quiet     = false;
+
+  virtual SerialMouseStatus setLineSettings(uint32_t dataRate, uint32_t dataSize, uint32_t stopBits) override {
+    return kSerialMouseSuccess;
+  }
+  virtual SerialMouseStatus setModemLines(bool rts, bool dtr) override { return kSerialMouseSuccess; }
+  virtual SerialMouseStatus setActive(bool active) override { return kSerialMouseSuccess; }
+  virtual SerialMouseStatus flushReceive() override { return kSerialMouseSuccess; }
+
+  virtual SerialMouseStatus readData(uint8_t *buffer, uint32_t size, uint32_t *count, uint32_t min) override {
+    *count = length < size ? length : size;
+    memcpy(buffer, data, *count);
+    data   += *count;
+    length -= *count;
+    return kSerialMouseSuccess;
+  }
+
+  virtual SerialMouseStatus writeData(const uint8_t *buffer, uint32_t size) override { return kSerialMouseSuccess; }
+  virtual SerialMouseStatus waitForData(bool packet) override { return kSerialMouseSuccess; }
+  virtual SerialMouseStatus setWakeupThreshold(uint32_t bytes) override { return kSerialMouseSuccess; }
+  virtual void sleep(uint32_t milliseconds) override { }
+  virtual uint64_t getUptimeNs() override { return timeNs; }
+
+  virtual void dispatchPointer(int32_t dx, int32_t dy, int32_t dz, uint32_t buttons, uint64_t timestampNs) override {
+    if (!quiet) {
+      printf("%llu.%06llu %d %d %d 0x%X\n", (unsigned long long) (timestampNs / 1000000000ULL),
+             (unsigned long long) (timestampNs % 1000000000ULL) / 1000, dx, dy, dz, buttons);
+    }
+  }
+};
+
+static void sleepUs(uint64_t us) {
+  struct timespec delay;
+  delay.tv_sec  = us / 1000000;
+  delay.tv_nsec = (us % 1000000) * 1000;
+  nanosleep(&delay, nullptr);
+}
+
+static void printHistogram(const char *name, const SerialMouseHistogram &histogram) {
+  fprintf(stderr, "%s:\n", name);
+  for (uint32_t i = 0; i < MOUSE_HISTOGRAM_BUCKETS; i++) {
+    if (histogram.buckets[i] != 0) {
+      fprintf(stderr, "  < %8llu us: %u\n", 1ULL << i, histogram.buckets[i]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  double      speed = 1.0;
+  bool        quiet = false;
+  bool        trace = false;
+  const char  *path = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      speed = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-q") == 0) {
+      quiet = true;
+    } else if (strcmp(argv[i], "-t") == 0) {
+      trace = true;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == nullptr || speed < 0) {
+    fprintf(stderr, "usage: %s [-s speed] [-q] [-t] capture\n", argv[0]);
+    fprintf(stderr, "  -s  replay speed multiplier, 0 replays as fast as possible (default 1)\n");
+    fprintf(stderr, "  -q  only print statistics\n");
+    fprintf(stderr, "  -t  print the last %u trace records\n", MOUSE_TRACE_COUNT);
+    return 1;
+  }
+
+  //
+  // Load the whole capture.
+  //
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr) {
+    perror(path);
+    return 1;
+  }
+  fseek(file, 0, SEEK_END);
+  long fileSize = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *capture = static_cast<uint8_t *>(malloc(fileSize > 0 ? fileSize : 1));
+  if (capture == nullptr || fread(capture, 1, fileSize, file) != (size_t) fileSize) {
+    fprintf(stderr, "%s: failed to read capture\n", path);
+    fclose(file);
+    return 1;
+  }
+  fclose(file);
+
+  SerialMouseCaptureHeader header;
+  if (!SerialMouseCapture::readHeader(capture, fileSize, &header)) {
+    fprintf(stderr, "%s: not a serial mouse capture\n", path);
+    return 1;
+  }
+  if (header.protocol >= kSerialMouseProtocolCount) {
+    fprintf(stderr, "%s: unknown protocol %u\n", path, header.protocol);
+    return 1;
+  }
+
+  ReplayAdapter   adapter;
+  SerialMouseCore core;
+  adapter.quiet = quiet;
+  core.attach(&adapter, &adapter);
+  core.setProtocol(static_cast<SerialMouseProtocol>(header.protocol));
+  core.getTrace().setEnabled(trace);
+
+  //
+  // Set up the port as the driver had it, packet times are derived from the byte time at the captured rate.
+  //
+  if (core.setupPort() != kSerialMouseSuccess
+      || (header.dataRate != 0 && core.setDataRate(header.dataRate) != kSerialMouseSuccess)) {
+    fprintf(stderr, "%s: failed to set up replay at %u baud\n", path, header.dataRate);
+    return 1;
+  }
+  fprintf(stderr, "Replaying protocol %u at %u baud\n", header.protocol, header.dataRate);
+
+  //
+  // Feed each record once its delay has passed, draining it the same way the driver does.
+  //
+  size_t offset  = MOUSE_CAPTURE_HEADER_SIZE;
+  bool   first   = true;
+  while (offset + MOUSE_CAPTURE_RECORD_SIZE <= (size_t) fileSize) {
+    const uint8_t *record = &capture[offset];
+    uint32_t deltaUs = record[0] | (record[1] << 8) | (record[2] << 16) | ((uint32_t) record[3] << 24);
+    uint32_t length  = record[4];
+    offset += MOUSE_CAPTURE_RECORD_SIZE;
+    if (offset + length > (size_t) fileSize) {
+      fprintf(stderr, "%s: truncated record\n", path);
+      break;
+    }
+
+    if (!first) {
+      adapter.timeNs += deltaUs * 1000ULL;
+      if (speed > 0) {
+        sleepUs((uint64_t) (deltaUs / speed));
+      }
+    }
+    first = false;
+
+    adapter.data   = &capture[offset];
+    adapter.length = length;
+    offset += length;
+
+    uint32_t count;
+    core.markWakeup();
+    do {
+      if (core.receiveData(0, &count) != kSerialMouseSuccess) {
+        break;
+      }
+      core.processRingBuffer();
+    } while (count > 0);
+  }
+
+  const SerialMouseStatistics &stats = core.getStatistics();
+  fprintf(stderr, "Bytes read:              %u\n", stats.bytesRead);
+  fprintf(stderr, "Packets decoded:         %u\n", stats.packetsDecoded);
+  fprintf(stderr, "Header resyncs:          %u\n", stats.headerResyncs);
+  fprintf(stderr, "Dropped partial packets: %u\n", stats.droppedPartialPackets);
+  fprintf(stderr, "Events dispatched:       %u\n", stats.eventsDispatched);
+  fprintf(stderr, "Coalesced packets:       %u\n", stats.coalescedPackets);
+  fprintf(stderr, "Null packets suppressed: %u\n", stats.nullPacketsSuppressed);
+  fprintf(stderr, "Packet rate:             %u\n", stats.packetRate);
+  printHistogram("Packet interval", core.getIntervalHistogram());
+
+  if (trace) {
+    static SerialMouseTraceRecord records[MOUSE_TRACE_COUNT];
+    char     line[96];
+    uint32_t count = core.getTrace().copyOut(records, MOUSE_TRACE_COUNT);
+    for (uint32_t i = 0; i < count; i++) {
+      SerialMouseTrace::format(records[i], line, sizeof (line));
+      printf("%s\n", line);
+    }
+  }
+
+  free(capture);
+  return 0;
+}
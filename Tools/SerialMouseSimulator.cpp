@@ -0,0 +1,466 @@
+//
+//  SerialMouseSimulator.cpp
+//  Serial mouse driver for macOS.
+//
+//  Copyright © 2018-2023 Goldfish64. All rights reserved.
+//
+//  Emulates a serial mouse on a pseudo-terminal, paced to real line timing.
+//
+//  Build from the repository root:
+//    c++ -std=c++14 -o SerialMouseSimulator Tools/SerialMouseSimulator.cpp
+//
+//  Pseudo-terminals have no modem lines, so a DTR drop is signalled in-band by the host writing a NUL byte.
+//  SerialMouseHost does this automatically when the port does not support modem lines.
+//
+
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// Emulated protocols.
+//
+typedef enum {
+  kSimProtocolMicrosoft,
+  kSimProtocolWheel,
+  kSimProtocolLogitech,
+  kSimProtocolMouseSystems
+} SimProtocol;
+
+//
+// Time from power up until the mouse starts reporting motion.
+//
+#define SIM_POWER_UP_DELAY_NS   200000000ULL
+#define SIM_TX_QUEUE_SIZE       1024
+
+struct SimMotion {
+  int32_t dx;
+  int32_t dy;
+  int32_t dz;
+  bool    left;
+  bool    right;
+  bool    middle;
+};
+
+class SerialMouseSimulator {
+private:
+  int         _master;
+  SimProtocol _protocol;
+  uint32_t    _baseDataRate;
+  uint32_t    _dataRate;
+  uint32_t    _reportRate;
+  bool        _continuous = false;
+  bool        _prompt     = false;
+  bool        _prefix     = false;
+  bool        _lastMiddle = false;
+
+  uint8_t  _txQueue[SIM_TX_QUEUE_SIZE];
+  uint32_t _txHead = 0;
+  uint32_t _txTail = 0;
+
+  uint64_t _nextByteNs   = 0;
+  uint64_t _nextReportNs = 0;
+  uint64_t _poweredNs    = 0;
+
+  FILE     *_script = nullptr;
+  uint32_t _seed    = 1;
+
+  uint64_t _packetsSent = 0;
+  uint64_t _bytesSent   = 0;
+
+  uint64_t getByteTimeNs() const {
+    uint32_t dataSize = (_protocol == kSimProtocolMouseSystems) ? 8 : 7;
+    return (1 + dataSize + 1) * 1000000000ULL / _dataRate;
+  }
+
+  uint64_t getReportIntervalNs() const {
+    uint32_t packetLength = (_protocol == kSimProtocolWheel) ? 4 : (_protocol == kSimProtocolMouseSystems) ? 5 : 3;
+    uint64_t minimumNs    = packetLength * getByteTimeNs();
+    uint64_t intervalNs   = (_reportRate != 0 && !_continuous) ? 1000000000ULL / _reportRate : 0;
+    return intervalNs > minimumNs ? intervalNs : minimumNs;
+  }
+
+  void queueByte(uint8_t byte) {
+    if (_txHead - _txTail < SIM_TX_QUEUE_SIZE) {
+      _txQueue[_txHead++ % SIM_TX_QUEUE_SIZE] = byte;
+    }
+  }
+
+  void queueString(const char *string) {
+    while (*string != '\0') {
+      queueByte((uint8_t) *string++);
+    }
+  }
+
+  uint32_t nextRandom() {
+    _seed = _seed * 1103515245 + 12345;
+    return (_seed >> 16) & 0x7FFF;
+  }
+
+  bool nextMotion(SimMotion *motion);
+  void queuePacket(const SimMotion &motion);
+  void powerUp(uint64_t nowNs);
+  void handleInput(uint8_t byte, uint64_t nowNs);
+
+public:
+  SerialMouseSimulator(int master, SimProtocol protocol, uint32_t dataRate, uint32_t reportRate)
+    : _master(master), _protocol(protocol), _baseDataRate(dataRate), _dataRate(dataRate), _reportRate(reportRate) { }
+
+  void setScript(FILE *script) { _script = script; }
+  void setSeed(uint32_t seed) { _seed = seed; }
+  int run(uint64_t durationNs);
+};
+
+static uint64_t getTimeNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int32_t clampDelta(int32_t delta) {
+  return delta < -128 ? -128 : (delta > 127 ? 127 : delta);
+}
+
+bool SerialMouseSimulator::nextMotion(SimMotion *motion) {
+  memset(motion, 0, sizeof (*motion));
+
+  //
+  // Script lines are "dx dy [dz [buttons]]", with buttons as a mask of 1 (left), 2 (right) and 4 (middle).
+  // The script is repeated once it ends.
+  //
+  if (_script != nullptr) {
+    char line[128];
+    for (int attempt = 0; attempt < 2; attempt++) {
+      while (fgets(line, sizeof (line), _script) != nullptr) {
+        int dx = 0, dy = 0, dz = 0, buttons = 0;
+        if (line[0] == '#' || sscanf(line, "%d %d %d %d", &dx, &dy, &dz, &buttons) < 2) {
+          continue;
+        }
+        motion->dx     = clampDelta(dx);
+        motion->dy     = clampDelta(dy);
+        motion->dz     = dz < -8 ? -8 : (dz > 7 ? 7 : dz);
+        motion->left   = (buttons & 1) != 0;
+        motion->right  = (buttons & 2) != 0;
+        motion->middle = (buttons & 4) != 0;
+        return true;
+      }
+      rewind(_script);
+    }
+    return false;
+  }
+
+  //
+  // Random motion with occasional clicks.
+  //
+  motion->dx = (int32_t) (nextRandom() % 31) - 15;
+  motion->dy = (int32_t) (nextRandom() % 31) - 15;
+  if (_protocol == kSimProtocolWheel && nextRandom() % 8 == 0) {
+    motion->dz = (nextRandom() & 1) ? 1 : -1;
+  }
+  uint32_t buttons = nextRandom() % 64;
+  motion->left   = buttons == 1;
+  motion->right  = buttons == 2;
+  motion->middle = buttons == 3 && _protocol != kSimProtocolMicrosoft;
+  return true;
+}
+
+void SerialMouseSimulator::queuePacket(const SimMotion &motion) {
+  uint8_t dx = (uint8_t) clampDelta(motion.dx);
+  uint8_t dy = (uint8_t) clampDelta(motion.dy);
+
+  if (_protocol == kSimProtocolMouseSystems) {
+    //
+    // Buttons are active low, and Y increases upwards. The motion is split across both deltas.
+    //
+    uint8_t dyUp = (uint8_t) clampDelta(-motion.dy);
+    queueByte(0x80 | (motion.left ? 0 : 0x4) | (motion.middle ? 0 : 0x2) | (motion.right ? 0 : 0x1));
+    queueByte(dx);
+    queueByte(dyUp);
+    queueByte(0);
+    queueByte(0);
+  } else {
+    queueByte(0x40 | (motion.left ? 0x20 : 0) | (motion.right ? 0x10 : 0) | ((dy >> 4) & 0xC) | ((dx >> 6) & 0x3));
+    queueByte(dx & 0x3F);
+    queueByte(dy & 0x3F);
+
+    if (_protocol == kSimProtocolWheel) {
+      queueByte((motion.middle ? 0x10 : 0) | (motion.dz & 0xF));
+    } else if (_protocol == kSimProtocolLogitech && (motion.middle || _lastMiddle)) {
+      //
+      // The extension byte is sent while the middle button is held and once more when it is released.
+      //
+      queueByte(motion.middle ? 0x20 : 0);
+    }
+  }
+
+  _lastMiddle = motion.middle;
+  _packetsSent++;
+}
+
+void SerialMouseSimulator::powerUp(uint64_t nowNs) {
+  //
+  // Power cycling resets the mouse to its default settings, then it identifies itself.
+  //
+  _txTail     = _txHead;
+  _dataRate   = _baseDataRate;
+  _continuous = false;
+  _prompt     = false;
+  _prefix     = false;
+  _lastMiddle = false;
+  _poweredNs  = nowNs;
+  _nextByteNs = nowNs;
+
+  switch (_protocol) {
+    case kSimProtocolMicrosoft:
+      queueString("M");
+      break;
+
+    case kSimProtocolWheel:
+      queueString("MZ@");
+      break;
+
+    case kSimProtocolLogitech:
+      queueString("M3");
+      break;
+
+    default:
+      break;
+  }
+  fprintf(stderr, "Power cycled, now at %u baud\n", _dataRate);
+}
+
+void SerialMouseSimulator::handleInput(uint8_t byte, uint64_t nowNs) {
+  if (byte == 0) {
+    powerUp(nowNs);
+    return;
+  }
+  if (_protocol != kSimProtocolLogitech) {
+    return;
+  }
+
+  //
+  // Data rate commands take effect once the command has been received.
+  //
+  if (_prefix) {
+    static const struct {
+      uint8_t  command;
+      uint32_t dataRate;
+    } dataRates[] = { { 'n', 1200 }, { 'o', 2400 }, { 'p', 4800 }, { 'q', 9600 } };
+
+    _prefix = false;
+    for (size_t i = 0; i < sizeof (dataRates) / sizeof (dataRates[0]); i++) {
+      if (dataRates[i].command == byte) {
+        _dataRate = dataRates[i].dataRate;
+        fprintf(stderr, "Data rate set to %u baud\n", _dataRate);
+      }
+    }
+    return;
+  }
+
+  static const struct {
+    uint8_t  command;
+    uint32_t reportRate;
+  } reportRates[] = {
+    { 'J', 10 }, { 'K', 20 }, { 'L', 35 }, { 'R', 50 }, { 'M', 70 }, { 'Q', 100 }, { 'N', 150 }
+  };
+
+  switch (byte) {
+    case '*':
+      _prefix = true;
+      break;
+
+    case 'D':
+      _prompt = true;
+      break;
+
+    case 'P': {
+      SimMotion motion = { };
+      queuePacket(motion);
+      break;
+    }
+
+    case 'O':
+      _prompt     = false;
+      _continuous = true;
+      fprintf(stderr, "Continuous reporting\n");
+      break;
+
+    default:
+      for (size_t i = 0; i < sizeof (reportRates) / sizeof (reportRates[0]); i++) {
+        if (reportRates[i].command == byte) {
+          _prompt     = false;
+          _continuous = false;
+          _reportRate = reportRates[i].reportRate;
+          fprintf(stderr, "Report rate set to %u\n", _reportRate);
+        }
+      }
+      break;
+  }
+}
+
+int SerialMouseSimulator::run(uint64_t durationNs) {
+  uint64_t startNs = getTimeNs();
+
+  powerUp(startNs);
+  _nextReportNs = startNs + SIM_POWER_UP_DELAY_NS;
+
+  while (durationNs == 0 || getTimeNs() - startNs < durationNs) {
+    uint64_t nowNs = getTimeNs();
+
+    //
+    // Send one byte per byte time. A sender that fell behind does not burst to catch up.
+    //
+    if (_txHead != _txTail && nowNs >= _nextByteNs) {
+      uint8_t byte = _txQueue[_txTail % SIM_TX_QUEUE_SIZE];
+      if (write(_master, &byte, 1) == 1) {
+        _txTail++;
+        _bytesSent++;
+      }
+      _nextByteNs = (_nextByteNs + getByteTimeNs() > nowNs) ? _nextByteNs + getByteTimeNs() : nowNs + getByteTimeNs();
+    }
+
+    //
+    // Queue the next report once the previous one has gone out.
+    //
+    if (!_prompt && _txHead == _txTail && nowNs >= _nextReportNs && nowNs - _poweredNs >= SIM_POWER_UP_DELAY_NS) {
+      SimMotion motion;
+      if (nextMotion(&motion)) {
+        queuePacket(motion);
+      }
+      _nextReportNs = (_nextReportNs + getReportIntervalNs() > nowNs) ? _nextReportNs + getReportIntervalNs()
+                                                                       : nowNs + getReportIntervalNs();
+    }
+
+    //
+    // Wait for host commands until the next byte or report is due.
+    //
+    uint64_t wakeNs  = (_txHead != _txTail) ? _nextByteNs : _nextReportNs;
+    int      timeout = (wakeNs > nowNs) ? (int) ((wakeNs - nowNs) / 1000000) : 0;
+    struct pollfd pollFd = { _master, POLLIN, 0 };
+
+    if (poll(&pollFd, 1, timeout) > 0 && (pollFd.revents & POLLIN)) {
+      uint8_t input[64];
+      ssize_t length = read(_master, input, sizeof (input));
+      for (ssize_t i = 0; i < length; i++) {
+        handleInput(input[i], getTimeNs());
+      }
+    } else if (wakeNs > getTimeNs()) {
+      //
+      // Sub-millisecond remainder of the wait.
+      //
+      uint64_t remainingNs = wakeNs - getTimeNs();
+      struct timespec delay = { (time_t) (remainingNs / 1000000000ULL), (long) (remainingNs % 1000000000ULL) };
+      nanosleep(&delay, nullptr);
+    }
+  }
+
+  fprintf(stderr, "Sent %llu packets, %llu bytes\n", (unsigned long long) _packetsSent,
+          (unsigned long long) _bytesSent);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  SimProtocol protocol   = kSimProtocolMicrosoft;
+  uint32_t    dataRate   = 1200;
+  uint32_t    reportRate = 0;
+  double      duration   = 0;
+  const char  *script    = nullptr;
+  uint32_t    seed       = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      const char *name = argv[++i];
+      if (strcmp(name, "microsoft") == 0) {
+        protocol = kSimProtocolMicrosoft;
+      } else if (strcmp(name, "wheel") == 0) {
+        protocol = kSimProtocolWheel;
+      } else if (strcmp(name, "logitech") == 0) {
+        protocol = kSimProtocolLogitech;
+      } else if (strcmp(name, "mousesystems") == 0) {
+        protocol = kSimProtocolMouseSystems;
+      } else {
+        fprintf(stderr, "Unknown protocol %s\n", name);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      dataRate = (uint32_t) atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      reportRate = (uint32_t) atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      duration = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      script = argv[++i];
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seed = (uint32_t) atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [-p protocol] [-b baud] [-r rate] [-d seconds] [-m script] [-s seed]\n", argv[0]);
+      fprintf(stderr, "  -p  microsoft (default), wheel, logitech or mousesystems\n");
+      fprintf(stderr, "  -b  power-up data rate (default 1200)\n");
+      fprintf(stderr, "  -r  reports per second, 0 sends as fast as the line allows (default 0)\n");
+      fprintf(stderr, "  -d  run time in seconds, 0 runs until interrupted (default 0)\n");
+      fprintf(stderr, "  -m  motion script of \"dx dy [dz [buttons]]\" lines, otherwise random motion\n");
+      fprintf(stderr, "  -s  random motion seed\n");
+      return 1;
+    }
+  }
+  if (dataRate == 0) {
+    fprintf(stderr, "Invalid data rate\n");
+    return 1;
+  }
+
+  //
+  // Create the pseudo-terminal. The slave is kept open so the master does not see a hangup between host runs.
+  //
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    perror("posix_openpt");
+    return 1;
+  }
+  const char *slaveName = ptsname(master);
+  int slave = open(slaveName, O_RDWR | O_NOCTTY);
+  if (slave < 0) {
+    perror(slaveName);
+    return 1;
+  }
+  struct termios settings;
+  tcgetattr(slave, &settings);
+  cfmakeraw(&settings);
+  tcsetattr(slave, TCSANOW, &settings);
+  printf("%s\n", slaveName);
+  fflush(stdout);
+
+  FILE *scriptFile = nullptr;
+  if (script != nullptr) {
+    scriptFile = fopen(script, "r");
+    if (scriptFile == nullptr) {
+      perror(script);
+      return 1;
+    }
+  }
+
+  SerialMouseSimulator simulator(master, protocol, dataRate, reportRate);
+  simulator.setScript(scriptFile);
+  simulator.setSeed(seed);
+  int result = simulator.run((uint64_t) (duration * 1000000000.0));
+
+  if (scriptFile != nullptr) {
+    fclose(scriptFile);
+  }
+  close(slave);
+  close(master);
+  return result;
+}